@@ -0,0 +1,841 @@
+#define _GNU_SOURCE /* accept4, etc. */
+
+#include "faio.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define ARRAY_SIZE(a)                                                         \
+  (sizeof(a) / sizeof((a)[0]))
+
+#define CONTAINER_OF(ptr, type, member)                                       \
+  ((type *) ((char *) (ptr) - (unsigned long) &((type *) 0)->member))
+
+#define E(expr)                                                               \
+  do {                                                                        \
+    errno = 0;                                                                \
+    do { expr; } while (0);                                                   \
+    if (errno) sys_error(#expr);                                              \
+  }                                                                           \
+  while (0)
+
+#define MAX_DEPTH 64
+
+/* Latency histogram with 32 linear sub-buckets per power of two, so any
+ * recorded value is off by at most 1/32nd.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist
+{
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+struct options
+{
+  struct sockaddr_in addr;
+  unsigned int connections;
+  unsigned int threads;
+  unsigned int depth;    /* Requests in flight per connection. */
+  unsigned int churn;    /* Requests per connection, 0 is unlimited. */
+  unsigned int idle;     /* Connections that never send anything. */
+  unsigned int think;    /* Milliseconds between response and request. */
+  unsigned int json:1;
+  double duration;
+};
+
+struct worker;
+
+struct conn
+{
+  struct faio_handle fh;
+  struct faio_timer think;
+  struct worker *w;
+  uint64_t sent[MAX_DEPTH]; /* Send times of the requests in flight. */
+  unsigned int head;        /* Oldest request in flight. */
+  unsigned int inflight;
+  unsigned int requests;    /* Requests sent on this connection. */
+  unsigned int wr_len;      /* Bytes left to write. */
+  unsigned int rd_len;
+  unsigned long body;       /* Body bytes of the current response left. */
+  unsigned int connected:1;
+  unsigned int in_body:1;
+  char wr_buf[MAX_DEPTH * 64];
+  char rd_buf[4096];
+};
+
+struct worker
+{
+  pthread_t thread;
+  struct faio_loop loop;
+  struct faio_timer timer;
+  struct conn *conns;
+  unsigned int nconns;
+  struct faio_handle *idle;
+  unsigned int nidle;
+  unsigned int idle_base;   /* Index of the first idle connection. */
+  uint64_t responses;
+  uint64_t errors;
+  uint64_t reconnects;
+  uint64_t start;
+  uint64_t end;
+  uint64_t deadline; /* No new requests after this, see conn_read(). */
+  struct hist hist;
+  int stop;
+};
+
+static const char request[] =
+  "GET / HTTP/1.1\r\n"
+  "Host: 127.0.0.1\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+/* Last request on a connection when churning. */
+static const char close_request[] =
+  "GET / HTTP/1.1\r\n"
+  "Host: 127.0.0.1\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static struct options opts;
+
+static void conn_cb(struct faio_loop *loop,
+                    struct faio_handle *fh,
+                    unsigned int revents);
+
+__attribute__((noreturn))
+static void sys_error(const char* what)
+{
+  fprintf(stderr, "%s: %s (errno=%d)\n", what, strerror(errno), errno);
+  exit(42);
+}
+
+#if defined(__linux__)
+
+static int nb_socket(int family, int type, int proto)
+{
+  return socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
+}
+
+#else /* !defined(__linux__) */
+
+#include <sys/filio.h>
+#include <sys/ioctl.h>
+
+static void nbio(int fd)
+{
+  int on;
+
+  on = 1;
+  E(ioctl(fd, FIONBIO, &on));
+  E(ioctl(fd, FIOCLEX));
+}
+
+static int nb_socket(int family, int type, int proto)
+{
+  int fd;
+
+  fd = socket(family, type, proto);
+  if (fd != -1)
+    nbio(fd);
+
+  return fd;
+}
+
+#endif /* defined(__linux__) */
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+  unsigned int shift;
+
+  if (v < HIST_SUB)
+    return v;
+
+  shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+  return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+static uint64_t hist_value(unsigned int index)
+{
+  unsigned int shift;
+
+  if (index < HIST_SUB)
+    return index;
+
+  shift = index / HIST_SUB - 1;
+
+  return (uint64_t) (index % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void hist_record(struct hist *h, uint64_t v)
+{
+  h->counts[hist_index(v)]++;
+  h->total++;
+
+  if (h->max < v)
+    h->max = v;
+}
+
+static void hist_merge(struct hist *h, const struct hist *other)
+{
+  unsigned int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    h->counts[i] += other->counts[i];
+
+  h->total += other->total;
+
+  if (h->max < other->max)
+    h->max = other->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+  uint64_t rank;
+  uint64_t seen;
+  unsigned int i;
+
+  rank = h->total * p / 100;
+  seen = 0;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+
+    if (seen > rank)
+      return hist_value(i);
+  }
+
+  return h->max;
+}
+
+static int conn_flush(struct conn *c)
+{
+  ssize_t n;
+
+  while (c->wr_len != 0) {
+    do
+      n = write(c->fh.fd, c->wr_buf, c->wr_len);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+      if (errno != EAGAIN)
+        return -1;
+
+      return faio_mod(&c->w->loop, &c->fh, FAIO_POLLIN | FAIO_POLLOUT);
+    }
+
+    c->wr_len -= n;
+    memmove(c->wr_buf, c->wr_buf + n, c->wr_len);
+  }
+
+  return faio_mod(&c->w->loop, &c->fh, FAIO_POLLIN);
+}
+
+/* Queue requests until the pipeline is full or the connection has sent
+ * as many requests as it's allowed to.
+ */
+static void conn_fill(struct conn *c)
+{
+  unsigned int slot;
+  unsigned int len;
+  const char *req;
+  uint64_t now;
+
+  now = now_ns();
+
+  while (c->inflight < opts.depth) {
+    if (opts.churn != 0 && c->requests == opts.churn)
+      break;
+
+    slot = (c->head + c->inflight) % MAX_DEPTH;
+    c->sent[slot] = now;
+    c->inflight++;
+    c->requests++;
+
+    req = request;
+    len = sizeof(request) - 1;
+
+    if (opts.churn != 0 && c->requests == opts.churn) {
+      req = close_request;
+      len = sizeof(close_request) - 1;
+    }
+
+    assert(c->wr_len + len <= sizeof(c->wr_buf));
+    memcpy(c->wr_buf + c->wr_len, req, len);
+    c->wr_len += len;
+  }
+}
+
+static void conn_start(struct worker *w, struct conn *c)
+{
+  int fd;
+  int on;
+
+  c->w = w;
+  c->head = 0;
+  c->inflight = 0;
+  c->requests = 0;
+  c->wr_len = 0;
+  c->rd_len = 0;
+  c->body = 0;
+  c->connected = 0;
+  c->in_body = 0;
+
+  E(fd = nb_socket(AF_INET, SOCK_STREAM, 0));
+  on = 1;
+  E(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)));
+
+  if (connect(fd, (struct sockaddr *) &opts.addr, sizeof(opts.addr)))
+    if (errno != EINPROGRESS)
+      sys_error("connect");
+
+  if (faio_add(&w->loop, &c->fh, conn_cb, fd, FAIO_POLLOUT))
+    sys_error("faio_add");
+
+  conn_fill(c);
+}
+
+static void conn_restart(struct conn *c)
+{
+  faio_timer_stop(&c->w->loop, &c->think);
+  faio_close(&c->w->loop, &c->fh);
+  c->fh.fd = -1;
+
+  if (c->w->stop)
+    return;
+
+  c->w->reconnects++;
+  conn_start(c->w, c);
+}
+
+/* Returns the length of the response headers at the start of |buf|, 0 if
+ * they're incomplete or -1 if they're malformed. The body length goes in
+ * |body|, bodies are skipped as they come in so they can be of any size.
+ */
+static int parse_response(const char *buf,
+                          unsigned int len,
+                          unsigned long *body)
+{
+  const char *end;
+  const char *p;
+
+  end = memmem(buf, len, "\r\n\r\n", 4);
+
+  if (end == NULL)
+    return len < 4096 ? 0 : -1;
+
+  end += 4;
+  *body = 0;
+
+  for (p = buf; p < end; p = memchr(p, '\n', end - p) + 1)
+    if (strncasecmp(p, "Content-Length:", 15) == 0)
+      *body = strtoul(p + 15, NULL, 10);
+
+  return end - buf;
+}
+
+static void think_cb(struct faio_loop *loop, struct faio_timer *timer)
+{
+  struct conn *c = CONTAINER_OF(timer, struct conn, think);
+
+  (void) loop;
+
+  if (c->w->stop)
+    return;
+
+  conn_fill(c);
+
+  if (conn_flush(c)) {
+    c->w->errors++;
+    conn_restart(c);
+  }
+}
+
+static int conn_read(struct conn *c)
+{
+  struct worker *w;
+  unsigned int skip;
+  uint64_t now;
+  ssize_t n;
+  int len;
+
+  w = c->w;
+
+  for (;;) {
+    do
+      n = read(c->fh.fd, c->rd_buf + c->rd_len, sizeof(c->rd_buf) - c->rd_len);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+      return errno == EAGAIN ? 0 : -1;
+
+    if (n == 0)
+      return -1; /* Connection closed by peer. */
+
+    c->rd_len += n;
+    now = now_ns();
+
+    for (len = 0; /* empty */; ) {
+      if (c->in_body) {
+        skip = c->rd_len;
+
+        if (skip > c->body)
+          skip = c->body;
+
+        c->body -= skip;
+        c->rd_len -= skip;
+        memmove(c->rd_buf, c->rd_buf + skip, c->rd_len);
+
+        if (c->body != 0)
+          break;
+
+        c->in_body = 0;
+        hist_record(&w->hist, now - c->sent[c->head]);
+        c->head = (c->head + 1) % MAX_DEPTH;
+        c->inflight--;
+        w->responses++;
+        continue;
+      }
+
+      len = parse_response(c->rd_buf, c->rd_len, &c->body);
+
+      if (len <= 0)
+        break;
+
+      if (c->inflight == 0)
+        return -1; /* Unsolicited response. */
+
+      c->rd_len -= len;
+      memmove(c->rd_buf, c->rd_buf + len, c->rd_len);
+      c->in_body = 1;
+    }
+
+    if (len == -1)
+      return -1;
+
+    /* Done with this connection, open a new one. */
+    if (c->inflight == 0 && opts.churn != 0 && c->requests == opts.churn) {
+      conn_restart(c);
+      return 1;
+    }
+
+    /* A fast server can keep this loop going forever, large responses
+     * especially. Don't rely on the stop timer getting a chance to run.
+     */
+    if (w->stop || now >= w->deadline)
+      return 0;
+
+    /* Slow client, wait a bit before sending the next request. */
+    if (opts.think != 0) {
+      if (c->inflight == 0)
+        faio_timer_start(&w->loop, &c->think, think_cb, opts.think / 1e3);
+
+      continue;
+    }
+
+    conn_fill(c);
+
+    if (conn_flush(c))
+      return -1;
+  }
+}
+
+static void conn_cb(struct faio_loop *loop,
+                    struct faio_handle *fh,
+                    unsigned int revents)
+{
+  struct conn *c = CONTAINER_OF(fh, struct conn, fh);
+  socklen_t len;
+  int err;
+  int r;
+
+  (void) loop;
+
+  if (revents & FAIO_POLLERR)
+    goto err;
+
+  if (c->connected == 0 && (revents & FAIO_POLLOUT)) {
+    len = sizeof(err);
+
+    if (getsockopt(fh->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err != 0)
+      goto err;
+
+    c->connected = 1;
+  }
+
+  if (c->connected == 0)
+    return;
+
+  if (revents & FAIO_POLLOUT)
+    if (conn_flush(c))
+      goto err;
+
+  if (revents & (FAIO_POLLIN | FAIO_POLLHUP)) {
+    r = conn_read(c);
+
+    if (r == -1)
+      goto err;
+
+    /* Reconnected, |revents| belongs to the old socket. */
+    if (r == 1)
+      return;
+  }
+
+  return;
+
+err:
+  c->w->errors++;
+  conn_restart(c);
+}
+
+/* Idle connections only watch for the server hanging up on them. */
+static void idle_cb(struct faio_loop *loop,
+                    struct faio_handle *fh,
+                    unsigned int revents)
+{
+  struct worker *w;
+  char buf[64];
+  ssize_t n;
+
+  (void) revents;
+
+  do
+    n = read(fh->fd, buf, sizeof(buf));
+  while (n == -1 && errno == EINTR);
+
+  if (n == -1 && errno == EAGAIN)
+    return;
+
+  w = CONTAINER_OF(loop, struct worker, loop);
+  w->errors++;
+  faio_close(loop, fh);
+  fh->fd = -1;
+}
+
+static void idle_start(struct worker *w,
+                       struct faio_handle *fh,
+                       unsigned int n)
+{
+  struct sockaddr_in src;
+  int fd;
+  int on;
+
+  E(fd = nb_socket(AF_INET, SOCK_STREAM, 0));
+
+#if defined(__linux__)
+  /* There are only so many ephemeral ports per source address. Spread the
+   * idle connections over 127.0.0.2 and up when the server is on loopback.
+   */
+  if ((ntohl(opts.addr.sin_addr.s_addr) >> 24) == 127) {
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+    on = 1;
+    E(setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)));
+#endif
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + n / 16384);
+    E(bind(fd, (struct sockaddr *) &src, sizeof(src)));
+  }
+#else
+  (void) src;
+  (void) on;
+  (void) n;
+#endif
+
+  if (connect(fd, (struct sockaddr *) &opts.addr, sizeof(opts.addr)))
+    if (errno != EINPROGRESS)
+      sys_error("connect");
+
+  if (faio_add(&w->loop, fh, idle_cb, fd, FAIO_POLLIN))
+    sys_error("faio_add");
+}
+
+static void stop_cb(struct faio_loop *loop, struct faio_timer *timer)
+{
+  struct worker *w = CONTAINER_OF(timer, struct worker, timer);
+
+  (void) loop;
+  w->stop = 1;
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w;
+  unsigned int i;
+
+  w = arg;
+
+  for (i = 0; i < w->nidle; i++)
+    idle_start(w, w->idle + i, w->idle_base + i);
+
+  /* Opening lots of idle connections takes a while. Update the loop time
+   * before starting the clock.
+   */
+  faio_poll(&w->loop, 0);
+  w->start = now_ns();
+  w->deadline = w->start + opts.duration * 1e9;
+
+  for (i = 0; i < w->nconns; i++)
+    conn_start(w, w->conns + i);
+
+  faio_timer_start(&w->loop, &w->timer, stop_cb, opts.duration);
+
+  while (w->stop == 0)
+    faio_poll(&w->loop, -1);
+
+  w->end = now_ns();
+
+  for (i = 0; i < w->nconns; i++)
+    if (w->conns[i].fh.fd != -1)
+      faio_close(&w->loop, &w->conns[i].fh);
+
+  for (i = 0; i < w->nidle; i++)
+    if (w->idle[i].fd != -1)
+      faio_close(&w->loop, w->idle + i);
+
+  return NULL;
+}
+
+static void usage(const char *progname)
+{
+  fprintf(stderr,
+          "usage: %s [-a <addr>] [-P <port>] [-c <connections>] "
+          "[-t <threads>]\n"
+          "       [-p <pipeline depth>] [-n <requests per connection>] "
+          "[-d <seconds>]\n"
+          "       [-i <idle connections>] [-w <think time in ms>] [-j]\n",
+          progname);
+  exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+  int c;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.addr.sin_family = AF_INET;
+  opts.addr.sin_port = htons(1234);
+  opts.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  opts.connections = 64;
+  opts.threads = 2;
+  opts.depth = 1;
+  opts.churn = 0;
+  opts.duration = 5;
+
+  while (-1 != (c = getopt(argc, argv, "a:P:c:t:p:n:d:i:w:jh"))) {
+    switch (c) {
+    case 'a':
+      if (inet_pton(AF_INET, optarg, &opts.addr.sin_addr) != 1)
+        usage(argv[0]);
+      break;
+    case 'P':
+      opts.addr.sin_port = htons(atoi(optarg));
+      break;
+    case 'c':
+      opts.connections = atoi(optarg);
+      break;
+    case 't':
+      opts.threads = atoi(optarg);
+      break;
+    case 'p':
+      opts.depth = atoi(optarg);
+      break;
+    case 'n':
+      opts.churn = atoi(optarg);
+      break;
+    case 'd':
+      opts.duration = atof(optarg);
+      break;
+    case 'i':
+      opts.idle = atoi(optarg);
+      break;
+    case 'w':
+      opts.think = atoi(optarg);
+      break;
+    case 'j':
+      opts.json = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (opts.threads == 0 || opts.connections < opts.threads)
+    usage(argv[0]);
+
+  if (opts.depth == 0 || opts.depth > MAX_DEPTH)
+    usage(argv[0]);
+
+  if (opts.duration <= 0)
+    usage(argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  struct worker *workers;
+  struct worker *w;
+  struct hist hist;
+  uint64_t responses;
+  uint64_t reconnects;
+  uint64_t errors;
+  uint64_t start;
+  uint64_t end;
+  double elapsed;
+  unsigned int nidle;
+  unsigned int i;
+
+  parse_options(argc, argv);
+  E(signal(SIGPIPE, SIG_IGN));
+
+  workers = calloc(opts.threads, sizeof(*workers));
+
+  if (workers == NULL)
+    abort();
+
+  nidle = 0;
+
+  for (i = 0; i < opts.threads; i++) {
+    w = workers + i;
+    w->nconns = opts.connections / opts.threads;
+
+    if (i < opts.connections % opts.threads)
+      w->nconns++;
+
+    w->conns = calloc(w->nconns, sizeof(*w->conns));
+
+    if (w->conns == NULL)
+      abort();
+
+    w->nidle = opts.idle / opts.threads;
+
+    if (i < opts.idle % opts.threads)
+      w->nidle++;
+
+    w->idle_base = nidle;
+    w->idle = calloc(w->nidle, sizeof(*w->idle));
+    nidle += w->nidle;
+
+    if (w->idle == NULL && w->nidle != 0)
+      abort();
+
+    if (faio_init(&w->loop))
+      sys_error("faio_init");
+  }
+
+  for (i = 0; i < opts.threads; i++)
+    if ((errno = pthread_create(&workers[i].thread,
+                                NULL,
+                                worker_main,
+                                workers + i)))
+    {
+      sys_error("pthread_create");
+    }
+
+  for (i = 0; i < opts.threads; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  memset(&hist, 0, sizeof(hist));
+  responses = 0;
+  reconnects = 0;
+  errors = 0;
+  start = UINT64_MAX;
+  end = 0;
+
+  for (i = 0; i < opts.threads; i++) {
+    w = workers + i;
+
+    if (start > w->start)
+      start = w->start;
+
+    if (end < w->end)
+      end = w->end;
+
+    hist_merge(&hist, &w->hist);
+    responses += w->responses;
+    reconnects += w->reconnects;
+    errors += w->errors;
+    faio_fini(&w->loop);
+    free(w->conns);
+    free(w->idle);
+  }
+
+  free(workers);
+  elapsed = (end - start) / 1e9;
+
+  if (opts.json) {
+    printf("{\"connections\": %u, \"idle\": %u, \"threads\": %u, "
+           "\"depth\": %u, \"churn\": %u, \"think_ms\": %u, "
+           "\"requests\": %llu, \"seconds\": %.3f, \"rps\": %.0f, "
+           "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+           "\"p999_us\": %.1f, \"max_us\": %.1f, "
+           "\"reconnects\": %llu, \"errors\": %llu}\n",
+           opts.connections,
+           opts.idle,
+           opts.threads,
+           opts.depth,
+           opts.churn,
+           opts.think,
+           (unsigned long long) responses,
+           elapsed,
+           responses / elapsed,
+           hist_percentile(&hist, 50) / 1e3,
+           hist_percentile(&hist, 90) / 1e3,
+           hist_percentile(&hist, 99) / 1e3,
+           hist_percentile(&hist, 99.9) / 1e3,
+           hist.max / 1e3,
+           (unsigned long long) reconnects,
+           (unsigned long long) errors);
+
+    return errors != 0 && responses == 0;
+  }
+
+  printf("%u connections, %u threads, pipeline depth %u\n",
+         opts.connections,
+         opts.threads,
+         opts.depth);
+  printf("requests:   %llu in %.2f s, %.0f req/s\n",
+         (unsigned long long) responses,
+         elapsed,
+         responses / elapsed);
+  printf("latency:    p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+         "p99.9 %.1f us, max %.1f us\n",
+         hist_percentile(&hist, 50) / 1e3,
+         hist_percentile(&hist, 90) / 1e3,
+         hist_percentile(&hist, 99) / 1e3,
+         hist_percentile(&hist, 99.9) / 1e3,
+         hist.max / 1e3);
+  printf("reconnects: %llu, errors: %llu\n",
+         (unsigned long long) reconnects,
+         (unsigned long long) errors);
+
+  return errors != 0 && responses == 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef BENCH_HTTP_H_
+#define BENCH_HTTP_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HTTP_SIMD 1
+#endif
+
+/* Request scanner for the bench servers. It only wants to know where a
+ * request ends and whether it has a "Connection: keep-alive" header, so
+ * all it does is find line ends, check for the empty line and look at
+ * the lines that start with a 'c'.
+ *
+ * http_parse_bytewise() is the original state machine that does that one
+ * byte at a time. http_parse() finds the line ends 16 bytes at a
+ * time and only falls back to the state machine for a Connection header
+ * that's split over two reads. Both resume where they left off.
+ */
+enum parse_state
+{
+  ps_new,
+  ps_eol,
+  ps_eol_2,
+  ps_connection_c,
+  ps_connection_co,
+  ps_connection_con,
+  ps_connection_conn,
+  ps_connection_conne,
+  ps_connection_connec,
+  ps_connection_connect,
+  ps_connection_connecti,
+  ps_connection_connectio,
+  ps_connection_connection,
+  ps_connection_connection_,
+  ps_connection_connection__,
+  ps_connection_connection__k,
+  ps_connection_connection__ke,
+  ps_connection_connection__kee,
+  ps_connection_connection__keep,
+  ps_connection_connection__keep_,
+  ps_connection_connection__keep_a,
+  ps_connection_connection__keep_al,
+  ps_connection_connection__keep_ali,
+  ps_connection_connection__keep_aliv,
+  ps_connection_connection__keep_alive,
+  ps_connection_connection__keep_alive_
+};
+
+struct http_parser
+{
+  enum parse_state ps;
+  unsigned int keep_alive:1;
+};
+
+static const char http__keep_alive[] = "connection: keep-alive";
+
+/* Parses up to the end of the next request. Returns the number of bytes
+ * consumed, p->ps is ps_eol_2 if they complete a request.
+ */
+__attribute__((unused))
+static unsigned int http_parse_bytewise(struct http_parser *p,
+                                        const char *buf,
+                                        unsigned int len)
+{
+  enum parse_state ps;
+  unsigned char ch;
+  unsigned int i;
+
+  ps = p->ps;
+
+  for (i = 0; i < len; i++) {
+    ch = buf[i];
+
+    if (ch == '\r')
+      continue;
+
+    if (ch >= 'A' && ch <= 'Z')
+      ch += 'a' - 'A';
+
+    if (ch == 'c' && ps == ps_eol) {
+      ps = ps_connection_co;
+      continue;
+    }
+
+    if (ps >= ps_connection_c &&
+        ps <= ps_connection_connection__keep_alive_ &&
+        ch == "connection: keep-alive\n"[ps - ps_connection_c])
+    {
+      if (ch != '\n')
+        ps += 1;
+      else {
+        ps = ps_eol;
+        p->keep_alive = 1;
+      }
+      continue;
+    }
+
+    if (ch != '\n')
+      ps = ps_new;
+    else if (ps != ps_eol)
+      ps = ps_eol;
+    else {
+      p->ps = ps_eol_2;
+      return i + 1;
+    }
+  }
+
+  p->ps = ps;
+
+  return len;
+}
+
+/* Returns the first '\n' in [s, end) or |end| if there's none. */
+__attribute__((unused))
+static const char *http__find_nl_memchr(const char *s, const char *end)
+{
+  const char *nl;
+
+  nl = memchr(s, '\n', end - s);
+
+  return nl != NULL ? nl : end;
+}
+
+#if defined(HTTP_SIMD)
+
+static const char *http__find_nl_sse2(const char *s, const char *end)
+{
+  __m128i nl;
+  int mask;
+
+  nl = _mm_set1_epi8('\n');
+
+  for (; end - s >= 16; s += 16) {
+    mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) s), nl));
+
+    if (mask != 0)
+      return s + __builtin_ctz(mask);
+  }
+
+  while (s < end && *s != '\n')
+    s++;
+
+  return s;
+}
+
+/* Only pays off for long lines like cookies. Most header lines are
+ * shorter than 32 bytes and bench-micro has it losing to SSE2 on every
+ * corpus, so http__find_nl_resolve() doesn't pick it.
+ */
+__attribute__((target("avx2"), unused))
+static const char *http__find_nl_avx2(const char *s, const char *end)
+{
+  __m256i nl;
+  int mask;
+
+  nl = _mm256_set1_epi8('\n');
+
+  for (; end - s >= 32; s += 32) {
+    mask = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) s), nl));
+
+    if (mask != 0)
+      return s + __builtin_ctz(mask);
+  }
+
+  return http__find_nl_sse2(s, end);
+}
+
+/* Case-insensitive compare of 22 bytes: OR'ing 0x20 into the positions
+ * that hold a letter in the pattern folds upper into lower case and maps
+ * nothing else onto a letter.
+ */
+static int http__match_keep_alive(const char *s)
+{
+  static const char fold[32] = {
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, /* connecti */
+    0x20, 0x20, 0, 0, 0x20, 0x20, 0x20, 0x20,       /* on: keep */
+    0, 0x20, 0x20, 0x20, 0x20, 0x20,                /* -alive */
+  };
+  __m128i lo;
+  __m128i hi;
+
+  lo = _mm_or_si128(_mm_loadu_si128((const __m128i *) s),
+                    _mm_loadu_si128((const __m128i *) fold));
+  hi = _mm_or_si128(_mm_loadu_si128((const __m128i *) (s + 6)),
+                    _mm_loadu_si128((const __m128i *) (fold + 6)));
+  lo = _mm_cmpeq_epi8(lo, _mm_loadu_si128((const __m128i *) http__keep_alive));
+  hi = _mm_cmpeq_epi8(hi,
+                      _mm_loadu_si128((const __m128i *) (http__keep_alive + 6)));
+
+  return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF;
+}
+
+#else /* !defined(HTTP_SIMD) */
+
+static int http__match_keep_alive(const char *s)
+{
+  unsigned char ch;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(http__keep_alive) - 1; i++) {
+    ch = s[i];
+
+    if (ch >= 'A' && ch <= 'Z')
+      ch += 'a' - 'A';
+
+    if (ch != (unsigned char) http__keep_alive[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+#endif /* defined(HTTP_SIMD) */
+
+static const char *http__find_nl_resolve(const char *s, const char *end);
+
+/* Picked on first use. */
+static const char *(*http__find_nl)(const char *, const char *) =
+    http__find_nl_resolve;
+
+/* SSE2 is part of x86-64. Elsewhere memchr() is usually vectorized too,
+ * it's just slower for short lines because of the call.
+ */
+static const char *http__find_nl_resolve(const char *s, const char *end)
+{
+#if defined(HTTP_SIMD)
+  http__find_nl = http__find_nl_sse2;
+#else
+  http__find_nl = http__find_nl_memchr;
+#endif
+
+  return http__find_nl(s, end);
+}
+
+/* Same contract as http_parse_bytewise(). */
+__attribute__((unused))
+static unsigned int http_parse(struct http_parser *p,
+                               const char *buf,
+                               unsigned int len)
+{
+  const char *end;
+  const char *nl;
+  const char *s;
+  size_t n;
+
+  s = buf;
+  end = buf + len;
+
+  while (s < end) {
+    switch (p->ps) {
+    case ps_new:
+      nl = http__find_nl(s, end);
+
+      if (nl == end)
+        return len;
+
+      p->ps = ps_eol;
+      s = nl + 1;
+      break;
+
+    case ps_eol:
+      /* Start of a line. The state machine ignores '\r' everywhere. */
+      while (s < end && *s == '\r')
+        s++;
+
+      if (s == end)
+        return len;
+
+      if (*s == '\n') {
+        p->ps = ps_eol_2;
+        return s + 1 - buf;
+      }
+
+      if ((*s | 0x20) != 'c') {
+        p->ps = ps_new;
+        break;
+      }
+
+      nl = http__find_nl(s, end);
+
+      /* Let the state machine take the rest, it can resume mid-line. */
+      if (nl == end)
+        return (s - buf) + http_parse_bytewise(p, s, end - s);
+
+      n = nl - s;
+
+      while (n > 0 && s[n - 1] == '\r')
+        n--;
+
+      if (n == sizeof(http__keep_alive) - 1 && http__match_keep_alive(s))
+        p->keep_alive = 1;
+
+      p->ps = ps_eol;
+      s = nl + 1;
+      break;
+
+    default:
+      /* A Connection header from the previous read, finish the line. The
+       * state machine can't see the end of a request before its end.
+       */
+      nl = http__find_nl(s, end);
+
+      if (nl != end)
+        nl++;
+
+      s += http_parse_bytewise(p, s, nl - s);
+      break;
+    }
+  }
+
+  return len;
+}
+
+#endif /* BENCH_HTTP_H_ */
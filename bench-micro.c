@@ -0,0 +1,615 @@
+#define _GNU_SOURCE /* accept4, etc. */
+
+#include "faio.h"
+#include "bench-http.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define ARRAY_SIZE(a)                                                         \
+  (sizeof(a) / sizeof((a)[0]))
+
+#define E(expr)                                                               \
+  do {                                                                        \
+    errno = 0;                                                                \
+    do { expr; } while (0);                                                   \
+    if (errno) sys_error(#expr);                                              \
+  }                                                                           \
+  while (0)
+
+#define QUEUE_NODES 1024
+#define HANDLES     1000
+#define PARSE_BYTES 65536
+
+/* Run each measurement for at least this long. */
+#define MIN_NS      200000000ULL
+
+#if defined(FAIO_URING_H_)
+# define BACKEND "io_uring"
+#elif defined(FAIO_EPOLL_H_)
+# define BACKEND "epoll"
+#elif defined(FAIO_PORT_H_)
+# define BACKEND "event ports"
+#else
+# define BACKEND "kqueue"
+#endif
+
+struct counter
+{
+  uint64_t ns;
+  uint64_t syscalls;
+};
+
+struct corpus
+{
+  const char *name;
+  const char *request;
+};
+
+struct scanner
+{
+  const char *name;
+  const char *(*find_nl)(const char *, const char *); /* NULL: bytewise. */
+};
+
+static const struct corpus corpora[] = {
+  { "bench",
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n" },
+  { "curl",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "browser",
+    "GET /static/js/app.3f2a1c9b.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/dashboard\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; "
+    "_ga=GA1.1.1234567890.1700000000\r\n"
+    "\r\n" },
+  { "proxied",
+    "GET /api/v1/items?page=2 HTTP/1.1\r\n"
+    "HOST: backend.internal:8080\r\n"
+    "X-Forwarded-For: 203.0.113.7, 10.0.0.2\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "X-Request-Id: 9b2c4c1e-5f0d-4c7a-9d3e-2a1b0c9d8e7f\r\n"
+    "Content-Length: 0\r\n"
+    "CONNECTION: Keep-Alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n" },
+};
+
+static struct faio__queue queue_nodes[QUEUE_NODES];
+static struct faio_handle *handles;
+static uint64_t callbacks;
+static int syscall_fd = -1;
+
+__attribute__((noreturn))
+static void sys_error(const char* what)
+{
+  fprintf(stderr, "%s: %s (errno=%d)\n", what, strerror(errno), errno);
+  exit(42);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__linux__)
+
+/* Counts this process's system calls with the raw_syscalls:sys_enter
+ * tracepoint. Needs tracefs and CAP_PERFMON or a permissive
+ * perf_event_paranoid, the syscalls/op column reads "-" otherwise.
+ */
+static void syscalls_open(void)
+{
+  static const char *const paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+  };
+  struct perf_event_attr attr;
+  unsigned long long id;
+  unsigned int i;
+  FILE *fp;
+
+  for (i = 0; i < ARRAY_SIZE(paths); i++) {
+    fp = fopen(paths[i], "r");
+
+    if (fp == NULL)
+      continue;
+
+    if (fscanf(fp, "%llu", &id) != 1)
+      id = 0;
+
+    fclose(fp);
+
+    if (id != 0)
+      break;
+  }
+
+  if (i == ARRAY_SIZE(paths))
+    return;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof(attr);
+  attr.config = id;
+  attr.sample_period = 1;
+
+  syscall_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#else /* !defined(__linux__) */
+
+static void syscalls_open(void)
+{
+}
+
+#endif /* defined(__linux__) */
+
+static uint64_t syscalls_read(void)
+{
+  uint64_t count;
+
+  if (syscall_fd == -1)
+    return 0;
+
+  if (read(syscall_fd, &count, sizeof(count)) != sizeof(count))
+    return 0;
+
+  return count;
+}
+
+static void counter_start(struct counter *c)
+{
+  c->syscalls = syscalls_read();
+  c->ns = now_ns();
+}
+
+static void counter_stop(struct counter *c, struct counter *total)
+{
+  uint64_t ns;
+
+  ns = now_ns();
+  total->ns += ns - c->ns;
+
+  /* Minus one for the read() that fetches the count. */
+  if (syscall_fd != -1)
+    total->syscalls += syscalls_read() - c->syscalls - 1;
+}
+
+static void report(const char *name, const struct counter *c, uint64_t ops)
+{
+  if (syscall_fd == -1)
+    printf("%-24s %10.1f %14s\n", name, (double) c->ns / ops, "-");
+  else
+    printf("%-24s %10.1f %14.2f\n",
+           name,
+           (double) c->ns / ops,
+           (double) c->syscalls / ops);
+}
+
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl))
+    return;
+
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static unsigned long fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl))
+    return 1024;
+
+  if (rl.rlim_cur == RLIM_INFINITY)
+    return (unsigned long) -1;
+
+  return rl.rlim_cur;
+}
+
+static void nop_cb(struct faio_loop *loop,
+                   struct faio_handle *handle,
+                   unsigned int revents)
+{
+  (void) loop;
+  (void) handle;
+  (void) revents;
+  callbacks++;
+}
+
+/* Parses |len| bytes, fed to the parser |chunk| bytes at a time. Returns
+ * the number of requests, |sig| gets a hash of their keep-alive flags.
+ */
+static unsigned int parse_all(const struct scanner *s,
+                              const char *buf,
+                              unsigned int len,
+                              unsigned int chunk,
+                              unsigned int *sig)
+{
+  struct http_parser p;
+  unsigned int requests;
+  unsigned int off;
+  unsigned int end;
+
+  memset(&p, 0, sizeof(p));
+  requests = 0;
+  *sig = 0;
+
+  if (s->find_nl != NULL)
+    http__find_nl = s->find_nl;
+
+  for (off = 0; off < len; off = end) {
+    end = off + chunk < len ? off + chunk : len;
+
+    while (off < end) {
+      if (s->find_nl != NULL)
+        off += http_parse(&p, buf + off, end - off);
+      else
+        off += http_parse_bytewise(&p, buf + off, end - off);
+
+      if (p.ps == ps_eol_2) {
+        requests++;
+        *sig = *sig * 31 + 1 + p.keep_alive;
+        p.ps = ps_new;
+        p.keep_alive = 0;
+      }
+    }
+  }
+
+  return requests;
+}
+
+/* Checks every scanner against the state machine with reads of different
+ * sizes, then times them on a buffer of back to back requests.
+ */
+static void bench_parser(void)
+{
+  static const unsigned int chunks[] = { 1, 7, 64, 1500, PARSE_BYTES };
+  static const struct scanner scanners[] = {
+    { "bytewise", NULL },
+    { "memchr", http__find_nl_memchr },
+#if defined(HTTP_SIMD)
+    { "sse2", http__find_nl_sse2 },
+    { "avx2", http__find_nl_avx2 },
+#endif
+  };
+  static char buf[PARSE_BYTES];
+  const struct scanner *s;
+  struct counter total;
+  struct counter c;
+  unsigned int expected_sig;
+  unsigned int expected;
+  unsigned int requests;
+  unsigned int size;
+  unsigned int sig;
+  unsigned int len;
+  unsigned int i;
+  unsigned int k;
+  unsigned int j;
+  uint64_t rounds;
+
+  printf("\n%-10s %-10s %12s %12s\n",
+         "corpus", "scanner", "ns/request", "MB/s");
+
+  for (i = 0; i < ARRAY_SIZE(corpora); i++) {
+    size = strlen(corpora[i].request);
+
+    for (len = 0; len + size <= sizeof(buf); len += size)
+      memcpy(buf + len, corpora[i].request, size);
+
+    expected = parse_all(scanners, buf, len, len, &expected_sig);
+
+    for (k = 0; k < ARRAY_SIZE(scanners); k++) {
+      s = scanners + k;
+
+#if defined(HTTP_SIMD)
+      if (s->find_nl == http__find_nl_avx2 && !__builtin_cpu_supports("avx2"))
+        continue;
+#endif
+
+      for (j = 0; j < ARRAY_SIZE(chunks); j++) {
+        requests = parse_all(s, buf, len, chunks[j], &sig);
+
+        if (requests != expected || sig != expected_sig) {
+          fprintf(stderr,
+                  "%s: %s disagrees with bytewise at %u byte reads\n",
+                  corpora[i].name,
+                  s->name,
+                  chunks[j]);
+          exit(1);
+        }
+      }
+
+      memset(&total, 0, sizeof(total));
+
+      for (rounds = 0; total.ns < MIN_NS; rounds++) {
+        counter_start(&c);
+        parse_all(s, buf, len, len, &sig);
+        counter_stop(&c, &total);
+      }
+
+      printf("%-10s %-10s %12.1f %12.0f\n",
+             corpora[i].name,
+             s->name,
+             (double) total.ns / (rounds * expected),
+             (double) rounds * len / (total.ns / 1e9) / 1e6);
+    }
+  }
+}
+
+static void bench_queue(void)
+{
+  struct counter append;
+  struct counter remove;
+  struct counter move;
+  struct counter c;
+  struct faio__queue head;
+  struct faio__queue list;
+  uint64_t rounds;
+  unsigned int i;
+
+  memset(&append, 0, sizeof(append));
+  memset(&remove, 0, sizeof(remove));
+  memset(&move, 0, sizeof(move));
+  faio__queue_init(&head);
+
+  for (rounds = 0; append.ns + remove.ns < MIN_NS; rounds++) {
+    counter_start(&c);
+
+    for (i = 0; i < QUEUE_NODES; i++)
+      faio__queue_append(&head, queue_nodes + i);
+
+    counter_stop(&c, &append);
+
+    counter_start(&c);
+
+    for (i = 0; i < QUEUE_NODES; i += 2) {
+      faio__queue_move(&head, &list);
+      faio__queue_move(&list, &head);
+    }
+
+    counter_stop(&c, &move);
+
+    counter_start(&c);
+
+    while (!faio__queue_empty(&head))
+      faio__queue_remove(faio__queue_head(&head));
+
+    counter_stop(&c, &remove);
+  }
+
+  report("faio__queue_append", &append, rounds * QUEUE_NODES);
+  report("faio__queue_remove", &remove, rounds * QUEUE_NODES);
+  report("faio__queue_move", &move, rounds * QUEUE_NODES);
+}
+
+static void bench_poll(struct faio_loop *loop)
+{
+  struct counter total;
+  struct counter c;
+  uint64_t rounds;
+
+  memset(&total, 0, sizeof(total));
+
+  for (rounds = 0; total.ns < MIN_NS; rounds++) {
+    counter_start(&c);
+    faio_poll(loop, 0);
+    counter_stop(&c, &total);
+  }
+
+  report("faio_poll(loop, 0)", &total, rounds);
+}
+
+/* faio_add() and faio_mod() may defer the work to the next poll, so the
+ * measurements include one faio_poll(loop, 0) per HANDLES operations.
+ */
+static void bench_handles(struct faio_loop *loop, int fd)
+{
+  struct counter add;
+  struct counter mod;
+  struct counter del;
+  struct counter c;
+  uint64_t rounds;
+  int fds[HANDLES];
+  unsigned int i;
+
+  memset(&add, 0, sizeof(add));
+  memset(&mod, 0, sizeof(mod));
+  memset(&del, 0, sizeof(del));
+
+  for (i = 0; i < HANDLES; i++)
+    E(fds[i] = dup(fd));
+
+  for (rounds = 0; add.ns + mod.ns + del.ns < MIN_NS; rounds++) {
+    counter_start(&c);
+
+    for (i = 0; i < HANDLES; i++)
+      faio_add(loop, handles + i, nop_cb, fds[i], FAIO_POLLIN);
+
+    faio_poll(loop, 0);
+    counter_stop(&c, &add);
+
+    counter_start(&c);
+
+    for (i = 0; i < HANDLES; i++)
+      faio_mod(loop, handles + i, FAIO_POLLIN | FAIO_POLLOUT);
+
+    faio_poll(loop, 0);
+    counter_stop(&c, &mod);
+
+    counter_start(&c);
+
+    for (i = 0; i < HANDLES; i++)
+      faio_del(loop, handles + i);
+
+    counter_stop(&c, &del);
+  }
+
+  for (i = 0; i < HANDLES; i++)
+    close(fds[i]);
+
+  report("faio_add", &add, rounds * HANDLES);
+  report("faio_mod", &mod, rounds * HANDLES);
+  report("faio_del", &del, rounds * HANDLES);
+}
+
+/* Registers |nhandles| handles, |nactive| of them on duplicates of the
+ * read end of |active| and the rest on duplicates of |idle|. Every round
+ * writes a byte to |active| so that all active handles become readable,
+ * then dispatches them with a single faio_poll(loop, 0). The write is part
+ * of the measurement because that's where the kernel queues the events,
+ * and with io_uring where it completes the poll requests.
+ */
+static void bench_dispatch(struct faio_loop *loop,
+                           unsigned int nhandles,
+                           unsigned int nactive,
+                           int active[2],
+                           int idle)
+{
+  struct counter total;
+  struct counter c;
+  uint64_t rounds;
+  char buf[256];
+  unsigned int i;
+  int fd;
+
+  if (nhandles + 64 > fd_limit()) {
+    printf("%8u %8u %12s\n", nhandles, nactive, "skipped, too few fds");
+    return;
+  }
+
+  for (i = 0; i < nhandles; i++) {
+    E(fd = dup(i < nactive ? active[0] : idle));
+    faio_add(loop, handles + i, nop_cb, fd, FAIO_POLLIN);
+  }
+
+  /* Registration and the initial POLLOUT edges aren't part of it. */
+  faio_poll(loop, 0);
+  memset(&total, 0, sizeof(total));
+  callbacks = 0;
+
+  for (rounds = 0; total.ns < MIN_NS; rounds++) {
+    counter_start(&c);
+    E(write(active[1], "x", 1));
+    faio_poll(loop, 0);
+    counter_stop(&c, &total);
+
+    while (read(active[0], buf, sizeof(buf)) == sizeof(buf));
+  }
+
+  for (i = 0; i < nhandles; i++)
+    faio_close(loop, handles + i);
+
+  if (syscall_fd == -1)
+    printf("%8u %8u %12.1f %12.0f %14s\n",
+           nhandles,
+           nactive,
+           (double) total.ns / callbacks,
+           callbacks / (total.ns / 1e9),
+           "-");
+  else
+    printf("%8u %8u %12.1f %12.0f %14.2f\n",
+           nhandles,
+           nactive,
+           (double) total.ns / callbacks,
+           callbacks / (total.ns / 1e9),
+           (double) total.syscalls / rounds);
+}
+
+int main(void)
+{
+  static const unsigned int sizes[] = { 1, 1000, 100000 };
+  static const unsigned int ratios[] = { 1, 10, 100 }; /* Percent active. */
+  struct faio_loop loop;
+  unsigned int nactive;
+  unsigned int i;
+  unsigned int k;
+  int active[2];
+  int idle[2];
+
+  raise_fd_limit();
+  syscalls_open();
+
+  handles = calloc(sizes[ARRAY_SIZE(sizes) - 1], sizeof(*handles));
+
+  if (handles == NULL)
+    abort();
+
+  E(socketpair(AF_UNIX, SOCK_STREAM, 0, active));
+  E(socketpair(AF_UNIX, SOCK_STREAM, 0, idle));
+  E(fcntl(active[0], F_SETFL, fcntl(active[0], F_GETFL) | O_NONBLOCK));
+
+  if (faio_init(&loop))
+    sys_error("faio_init");
+
+  printf("backend: %s\n\n", BACKEND);
+  printf("%-24s %10s %14s\n", "primitive", "ns/op", "syscalls/op");
+
+  bench_queue();
+  bench_poll(&loop);
+  bench_handles(&loop, idle[0]);
+
+  printf("\n%8s %8s %12s %12s %14s\n",
+         "handles", "active", "ns/event", "events/s", "syscalls/poll");
+
+  for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+    for (k = 0; k < ARRAY_SIZE(ratios); k++) {
+      nactive = (unsigned long long) sizes[i] * ratios[k] / 100;
+
+      /* 1% of 1 handle is the same as 100%. */
+      if (nactive == 0)
+        continue;
+
+      bench_dispatch(&loop, sizes[i], nactive, active, idle[0]);
+    }
+  }
+
+  bench_parser();
+
+  faio_fini(&loop);
+  free(handles);
+
+  return 0;
+}
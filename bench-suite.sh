@@ -0,0 +1,164 @@
+#!/bin/sh
+#
+# Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+# Runs each server binary through a fixed set of loopback scenarios with
+# bench-client and prints the results as a JSON array on stdout, one object
+# per server and scenario.
+#
+#   usage: bench-suite.sh [server ...]
+#
+# SUITE_DURATION sets the length of each run in seconds, default 5.
+#
+# Syscall counts come from `perf stat` when it's installed and permitted.
+# On Linux without perf they come from /proc/<pid>/io and only cover the
+# read and write families; "syscalls_source" says which one was used.
+
+DURATION=${SUITE_DURATION:-5}
+PORT=1234
+TMP=${TMPDIR:-/tmp}/faio-suite.$$
+
+trap 'rm -f "$TMP".*' EXIT
+
+have_perf() {
+  command -v perf >/dev/null 2>&1 &&
+    perf stat -e raw_syscalls:sys_enter true >/dev/null 2>&1
+}
+
+proc_syscalls() {
+  awk '/^sysc[rw]:/ { n += $2 } END { print n + 0 }' "/proc/$1/io"
+}
+
+raise_fd_limit() {
+  limit=$(ulimit -S -n)
+  [ "$limit" = unlimited ] || [ "$limit" -ge "$1" ] ||
+    ulimit -S -n "$1" 2>/dev/null
+}
+
+# The previous server's listen socket can linger for a moment after it
+# exits, io_uring tears down its requests asynchronously. Retry until the
+# bind succeeds and the server answers requests.
+start_server() {
+  i=0
+  while [ $i -lt 50 ]; do
+    BENCH_RUSAGE=1 "./$1" 2>"$TMP.server" &
+    pid=$!
+    sleep 0.1
+    if kill -0 $pid 2>/dev/null &&
+       ./bench-client -P $PORT -c 1 -t 1 -d 0.01 >/dev/null 2>&1; then
+      return 0
+    fi
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    i=$((i + 1))
+  done
+  return 1
+}
+
+# scenario <server> <name> <idle connections> <bench-client flags...>
+scenario() {
+  server=$1
+  name=$2
+  idle=$3
+  shift 3
+
+  printf '%s\n  ' "$sep"
+  sep=","
+
+  # Both ends need a descriptor per idle connection.
+  if ! raise_fd_limit $((idle + 4096)); then
+    printf '{"server": "%s", "scenario": "%s", "skipped": "%s"}' \
+           "$server" "$name" "descriptor limit too low"
+    return 0
+  fi
+
+  if ! start_server "$server"; then
+    printf '{"server": "%s", "scenario": "%s", "skipped": "%s"}' \
+           "$server" "$name" "server did not start"
+    return 0
+  fi
+
+  source=none
+  before=0
+
+  if have_perf; then
+    source=perf
+    perf stat -x, -o "$TMP.perf" -e raw_syscalls:sys_enter -p $pid &
+    perf=$!
+  elif [ -r "/proc/$pid/io" ]; then
+    source=proc-io
+    before=$(proc_syscalls $pid)
+  fi
+
+  ./bench-client -P $PORT -d "$DURATION" -i "$idle" -j "$@" >"$TMP.client"
+
+  case $source in
+    perf)
+      kill -INT $perf
+      wait $perf
+      syscalls=$(awk -F, '/raw_syscalls/ { print $1 }' "$TMP.perf")
+      ;;
+    proc-io)
+      syscalls=$(($(proc_syscalls $pid) - before))
+      ;;
+    *)
+      syscalls=null
+      ;;
+  esac
+
+  rss=$(ps -o rss= -p $pid | tr -d ' ')
+
+  kill -TERM $pid
+  wait $pid
+
+  # The client's numbers go in a nested object, the server's at the top.
+  awk -v server="$server" -v name="$name" -v syscalls="$syscalls" \
+      -v source="$source" -v rss="${rss:-null}" '
+    FILENAME ~ /server$/ && /^rusage:/ {
+      maxrss = $3; user = $5; sys = $8; nvcsw = $11; nivcsw = $13
+      sub(/,$/, "", maxrss); sub(/,$/, "", nvcsw)
+      next
+    }
+    FILENAME ~ /client$/ { client = $0 }
+    END {
+      if (client == "") client = "null"
+      if (maxrss == "") maxrss = user = sys = nvcsw = nivcsw = "null"
+      per_req = "null"
+      if (syscalls != "null" && client ~ /"requests": [1-9]/) {
+        split(client, a, /"requests": /)
+        per_req = sprintf("%.2f", syscalls / (a[2] + 0))
+      }
+      printf("{\"server\": \"%s\", \"scenario\": \"%s\", \"client\": %s, " \
+             "\"syscalls\": %s, \"syscalls_source\": \"%s\", " \
+             "\"syscalls_per_request\": %s, \"rss_kb\": %s, " \
+             "\"maxrss\": %s, \"user_s\": %s, \"system_s\": %s, " \
+             "\"nvcsw\": %s, \"nivcsw\": %s}",
+             server, name, client, syscalls, source, per_req, rss,
+             maxrss, user, sys, nvcsw, nivcsw)
+    }' "$TMP.server" "$TMP.client"
+}
+
+[ $# -eq 0 ] && set -- bench
+
+sep="["
+for server in "$@"; do
+  scenario $server keepalive 0 -c 64 -t 2
+  scenario $server close 0 -c 64 -t 2 -n 1
+  scenario $server slow 0 -c 256 -t 2 -w 10
+  scenario $server idle-10k 10000 -c 64 -t 2
+  scenario $server idle-100k 100000 -c 64 -t 2
+  scenario $server pipelined 0 -c 32 -t 2 -p 16
+done
+printf '\n]\n'
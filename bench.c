@@ -1,6 +1,7 @@
 #define _GNU_SOURCE /* accept4, etc. */
 
 #include "faio.h"
+#include "bench-http.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -8,6 +9,9 @@
 #include <string.h>
 #include <assert.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,6 +20,14 @@
 
 #include <netinet/in.h>
 
+/* Static file mode, see BENCH_ROOT in main(). */
+#if defined(__linux__) && !defined(BENCH_COMPLETION)
+#define BENCH_STATIC 1
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#endif
+
 #define ARRAY_SIZE(a)                                                         \
   (sizeof(a) / sizeof((a)[0]))
 
@@ -30,49 +42,64 @@
   }                                                                           \
   while (0)
 
-enum parse_state
-{
-  ps_new,
-  ps_eol,
-  ps_eol_2,
-  ps_connection_c,
-  ps_connection_co,
-  ps_connection_con,
-  ps_connection_conn,
-  ps_connection_conne,
-  ps_connection_connec,
-  ps_connection_connect,
-  ps_connection_connecti,
-  ps_connection_connectio,
-  ps_connection_connection,
-  ps_connection_connection_,
-  ps_connection_connection__,
-  ps_connection_connection__k,
-  ps_connection_connection__ke,
-  ps_connection_connection__kee,
-  ps_connection_connection__keep,
-  ps_connection_connection__keep_,
-  ps_connection_connection__keep_a,
-  ps_connection_connection__keep_al,
-  ps_connection_connection__keep_ali,
-  ps_connection_connection__keep_aliv,
-  ps_connection_connection__keep_alive,
-  ps_connection_connection__keep_alive_,
-  ps_error
-};
+/* Keep-alive responses to pipelined requests go out in batches of up to
+ * this many, from one buffer with the responses back to back.
+ */
+#define RESPONSE_BATCH 64
+
+#if defined(BENCH_STATIC)
+
+/* Files are sent in chunks of this size. It's also the unit that's checked
+ * for page cache residency and read in by the fetch thread.
+ */
+#define FILE_CHUNK    (1 << 20)
+#define FILE_BUCKETS  1024
 
-struct write_req
+/* Pipelined requests that can wait for their turn. */
+#define FILE_PIPELINE 16
+
+struct file
 {
-  const void* buf;
-  unsigned int len;
+  struct file *next; /* Hash chain. */
+  char *path;
+  int fd;
+  off_t size;
+  void *map; /* For mincore(), NULL for empty files. */
 };
 
+#endif /* defined(BENCH_STATIC) */
+
 struct client
 {
+#if defined(BENCH_COMPLETION)
+  struct faio_req read_req;
+  struct faio_req write_req;
+  int fd;
+  unsigned int closing:1;
+  unsigned int writing; /* Responses in the write in flight. */
+#else
   struct faio_handle fh;
-  enum parse_state ps;
-  struct write_req wr;
-  unsigned int keep_alive:1;
+  struct faio_writeq wq;
+  struct faio_wbuf wbufs[4];
+  unsigned int nwbufs; /* All free again once the queue is empty. */
+#endif
+#if defined(BENCH_STATIC)
+  struct faio_async_node fetch_node;
+  struct client *fetch_next;
+  struct file *file; /* Being sent, NULL if none. */
+  struct file *pipeline[FILE_PIPELINE]; /* NULL is a 404. */
+  unsigned int pipeline_head;
+  off_t offset;
+  unsigned int fetching:1;
+  unsigned int closing:1;
+  unsigned int line_done:1;
+  unsigned int line_len;
+  char line[256]; /* Request line. */
+  char header[256];
+#endif
+  struct http_parser parser;
+  unsigned int pending; /* Requests that haven't been answered yet. */
+  unsigned int last_request:1; /* Close after answering it. */
 };
 
 static const char keepalive_response[] =
@@ -91,6 +118,44 @@ static const char connection_close_response[] =
   "\r\n"
   "OK\r\n";
 
+static char keepalive_batch[RESPONSE_BATCH * (sizeof(keepalive_response) - 1)];
+
+static struct faio_slab clients;
+
+/* See BENCH_THREADS in main(). The slab isn't thread-safe. */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int nthreads = 1;
+
+#if defined(BENCH_STATIC)
+static int root_fd = -1;
+#endif
+
+static struct client *client_alloc(void)
+{
+  struct client *c;
+
+  if (nthreads == 1)
+    return faio_slab_alloc(&clients);
+
+  pthread_mutex_lock(&clients_lock);
+  c = faio_slab_alloc(&clients);
+  pthread_mutex_unlock(&clients_lock);
+
+  return c;
+}
+
+static void client_free(struct client *c)
+{
+  if (nthreads == 1) {
+    faio_slab_free(&clients, c);
+    return;
+  }
+
+  pthread_mutex_lock(&clients_lock);
+  faio_slab_free(&clients, c);
+  pthread_mutex_unlock(&clients_lock);
+}
+
 __attribute__((noreturn))
 static void sys_error(const char* what)
 {
@@ -105,11 +170,6 @@ static int nb_socket(int family, int type, int proto)
   return socket(family, type | SOCK_NONBLOCK, proto);
 }
 
-static int nb_accept(int fd, struct sockaddr *saddr, socklen_t *slen)
-{
-  return accept4(fd, saddr, slen, SOCK_NONBLOCK);
-}
-
 #else /* !defined(__linux__) */
 
 #include <sys/filio.h>
@@ -134,17 +194,6 @@ static int nb_socket(int family, int type, int proto)
   return fd;
 }
 
-static int nb_accept(int sfd, struct sockaddr *saddr, socklen_t *slen)
-{
-  int fd;
-
-  fd = accept(sfd, saddr, slen);
-  if (fd != -1)
-    nbio(fd);
-
-  return fd;
-}
-
 #endif /* defined(__linux__) */
 
 static int create_server(unsigned short port)
@@ -167,131 +216,845 @@ static int create_server(unsigned short port)
   return fd;
 }
 
-static int client_parse(struct client *c, const char *buf, unsigned int len)
+#if defined(BENCH_STATIC)
+static int client_queue_file(struct client *c);
+static void client_save_line(struct client *c,
+                             const char *buf,
+                             unsigned int len);
+#endif
+
+/* Counts the complete requests in |buf|. Anything after a request without
+ * keep-alive is ignored, the connection closes once it's been answered.
+ */
+static int client_consume(struct client *c, const char *buf, unsigned int len)
 {
-  enum parse_state ps;
-  unsigned char ch;
-  unsigned int i;
+  unsigned int n;
+
+  while (len > 0 && c->last_request == 0) {
+    n = http_parse(&c->parser, buf, len);
 
-  ps = c->ps;
+#if defined(BENCH_STATIC)
+    if (root_fd != -1)
+      client_save_line(c, buf, n);
+#endif
 
-  for (i = 0; i < len; i++) {
-    ch = buf[i];
+    buf += n;
+    len -= n;
 
-    if (ch == '\r')
+    if (c->parser.ps != ps_eol_2)
       continue;
 
-    if (ch >= 'A' && ch <= 'Z')
-      ch += 'a' - 'A';
+#if defined(BENCH_STATIC)
+    if (root_fd != -1)
+      if (client_queue_file(c))
+        return -1;
+#endif
 
-    if (ch == 'c' && ps == ps_eol) {
-      ps = ps_connection_co;
-      continue;
+    c->pending++;
+
+    if (c->parser.keep_alive == 0)
+      c->last_request = 1;
+
+    c->parser.ps = ps_new;
+    c->parser.keep_alive = 0;
+  }
+
+  return 0;
+}
+
+#if defined(BENCH_COMPLETION)
+
+static void client_write_cb(struct faio_loop *loop,
+                            struct faio_req *req,
+                            int result);
+
+/* Answers the pending requests, a batch at a time. */
+static int client_send_responses(struct faio_loop *loop, struct client *c)
+{
+  const char *buf;
+  unsigned int n;
+  size_t len;
+
+  if (c->write_req.active || c->pending == 0)
+    return 0;
+
+  if (c->pending == 1 && c->last_request) {
+    n = 1;
+    buf = connection_close_response;
+    len = sizeof(connection_close_response) - 1;
+  }
+  else {
+    n = c->pending - c->last_request;
+
+    if (n > RESPONSE_BATCH)
+      n = RESPONSE_BATCH;
+
+    buf = keepalive_batch;
+    len = n * (sizeof(keepalive_response) - 1);
+  }
+
+  c->writing = n;
+
+  return faio_write(loop, &c->write_req, client_write_cb, c->fd, buf, len);
+}
+
+static void client_release(struct client *c)
+{
+  /* Wait for the final callbacks of the cancelled requests. */
+  if (c->read_req.active || c->write_req.active)
+    return;
+
+  close(c->fd);
+  client_free(c);
+}
+
+static void client_close(struct faio_loop *loop, struct client *c)
+{
+  if (c->closing == 0) {
+    c->closing = 1;
+    faio_cancel(loop, &c->read_req);
+    faio_cancel(loop, &c->write_req);
+  }
+
+  client_release(c);
+}
+
+static void client_write_cb(struct faio_loop *loop,
+                            struct faio_req *req,
+                            int result)
+{
+  struct client *c = CONTAINER_OF(req, struct client, write_req);
+
+  if (c->closing) {
+    client_release(c);
+    return;
+  }
+
+  if (result < 0)
+    goto err;
+
+  c->pending -= c->writing;
+  c->writing = 0;
+
+  if (c->pending == 0 && c->last_request)
+    goto err;
+
+  if (client_send_responses(loop, c))
+    goto err;
+
+  return;
+
+err:
+  client_close(loop, c);
+}
+
+static void client_read_cb(struct faio_loop *loop,
+                           struct faio_req *req,
+                           int result)
+{
+  struct client *c = CONTAINER_OF(req, struct client, read_req);
+
+  if (c->closing) {
+    client_release(c);
+    return;
+  }
+
+  if (result <= 0)
+    goto err; /* Error or connection closed by peer. */
+
+  if (client_consume(c, req->buf, result))
+    goto err;
+
+  if (client_send_responses(loop, c))
+    goto err;
+
+  return;
+
+err:
+  client_close(loop, c);
+}
+
+static struct faio_req server_req;
+static struct faio_timer accept_timer;
+static int accept_spare = -1;
+
+/* Out of file descriptors, the connections stay in the backlog. Make room
+ * with the spare descriptor and drop them, like faio_listener does.
+ * Returns -1 if the spare is gone.
+ */
+static int accept_shed(int fd)
+{
+  unsigned int n;
+  int peer;
+
+  if (accept_spare == -1)
+    return -1;
+
+  close(accept_spare);
+
+  for (n = 0; n < 64; n++) {
+    peer = accept(fd, NULL, NULL);
+
+    if (peer == -1)
+      break;
+
+    close(peer);
+  }
+
+  accept_spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  return 0;
+}
+
+static void accept_cb(struct faio_loop *loop,
+                      struct faio_req *req,
+                      int result);
+
+static void accept_retry_cb(struct faio_loop *loop, struct faio_timer *timer)
+{
+  (void) timer;
+
+  if (faio_accept(loop, &server_req, accept_cb, server_req.fd))
+    abort();
+}
+
+static void accept_cb(struct faio_loop *loop,
+                      struct faio_req *req,
+                      int result)
+{
+  struct client *c;
+
+  if (result < 0) {
+    /* Multishot accept carries on after this one. */
+    if (req->active)
+      return;
+
+    switch (-result) {
+    /* Re-arming right away would fail again and spin. */
+    case EMFILE:
+    case ENFILE:
+      if (accept_shed(req->fd) == 0)
+        break;
+      /* Fall through. */
+    case ENOBUFS:
+    case ENOMEM:
+      faio_timer_start(loop, &accept_timer, accept_retry_cb, 0.1);
+      return;
+
+    /* Problems with the connection that was being accepted. */
+    case EAGAIN:
+    case EINTR:
+    case ECONNABORTED:
+    case EPERM:
+    case EPROTO:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ENONET:
+    case ENOPROTOOPT:
+    case EOPNOTSUPP:
+      break;
+
+    default:
+      errno = -result;
+      sys_error("accept");
     }
 
-    if (ps >= ps_connection_c &&
-        ps <= ps_connection_connection__keep_alive_ &&
-        ch == "connection: keep-alive\n"[ps - ps_connection_c])
-    {
-      if (ch != '\n')
-        ps += 1;
-      else {
-        ps = ps_eol;
-        c->keep_alive = 1;
-      }
+    if (faio_accept(loop, req, accept_cb, req->fd))
+      abort();
+
+    return;
+  }
+
+  c = client_alloc();
+
+  if (c == NULL)
+    abort();
+
+  memset(c, 0, sizeof(*c));
+  c->fd = result;
+
+  if (faio_read(loop, &c->read_req, client_read_cb, c->fd))
+    abort();
+}
+
+#else /* !defined(BENCH_COMPLETION) */
+
+/* Large response mode, see BENCH_RESPONSE_SIZE in main(). Indexed by the
+ * client's keep_alive flag.
+ */
+static char large_headers[2][128];
+static size_t large_headers_len[2];
+static char *large_body;
+static size_t large_len;
+static size_t zerocopy_threshold;
+
+static int client_write(struct faio_loop *loop, struct client *c);
+static void client_destroy(struct faio_loop *loop, struct client *c);
+
+#if defined(BENCH_STATIC)
+
+/* Open files and their sizes are cached for the lifetime of the process
+ * and never revalidated, the document root is assumed to be static.
+ */
+static struct file *files[FILE_BUCKETS];
+static long page_size;
+
+/* Reads from cold files block, so they're done by the fetch thread. It
+ * pulls the next chunk into the page cache and hands the client back to
+ * the loop with an async handle.
+ */
+static pthread_t fetch_thread;
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond = PTHREAD_COND_INITIALIZER;
+static struct client *fetch_head;
+static struct client **fetch_tail = &fetch_head;
+static struct faio_async fetch_async;
+static int fetch_quit;
+
+static const char not_found_body[] = "Not Found\r\n";
+
+static unsigned int file_hash(const char *path)
+{
+  unsigned int h;
+
+  /* FNV-1a. */
+  for (h = 2166136261U; *path != '\0'; path++)
+    h = (h ^ (unsigned char) *path) * 16777619U;
+
+  return h;
+}
+
+/* |path| is relative to the document root. Returns NULL if it doesn't
+ * exist or isn't a regular file.
+ */
+static struct file *file_open(const char *path)
+{
+  struct stat st;
+  struct file *f;
+  unsigned int h;
+  int fd;
+
+  h = file_hash(path) % FILE_BUCKETS;
+
+  for (f = files[h]; f != NULL; f = f->next)
+    if (strcmp(f->path, path) == 0)
+      return f;
+
+  fd = openat(root_fd, *path ? path : "index.html", O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+    return NULL;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+    goto err;
+
+  f = calloc(1, sizeof(*f));
+
+  if (f == NULL)
+    goto err;
+
+  f->path = strdup(path);
+
+  if (f->path == NULL) {
+    free(f);
+    goto err;
+  }
+
+  if (st.st_size > 0) {
+    f->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (f->map == MAP_FAILED)
+      f->map = NULL;
+  }
+
+  f->fd = fd;
+  f->size = st.st_size;
+  f->next = files[h];
+  files[h] = f;
+
+  return f;
+
+err:
+  close(fd);
+  return NULL;
+}
+
+/* Returns 1 if the range is in the page cache, 0 if sending it would
+ * block on disk I/O.
+ */
+static int file_resident(struct file *f, off_t offset, size_t len)
+{
+  unsigned char vec[FILE_CHUNK / 4096 + 2];
+  size_t start;
+  size_t end;
+  size_t i;
+  size_t n;
+
+  /* Nothing to check, let sendfile() block if it must. */
+  if (f->map == NULL)
+    return 1;
+
+  start = offset & ~(page_size - 1);
+  end = offset + len;
+  n = (end - start + page_size - 1) / page_size;
+  assert(n <= sizeof(vec));
+
+  if (mincore((char *) f->map + start, end - start, vec))
+    return 1;
+
+  for (i = 0; i < n; i++)
+    if ((vec[i] & 1) == 0)
+      return 0;
+
+  return 1;
+}
+
+static void *fetch_main(void *arg)
+{
+  static char buf[65536];
+  struct client *c;
+  struct file *f;
+  off_t offset;
+  off_t end;
+  size_t len;
+  ssize_t n;
+
+  (void) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&fetch_lock);
+
+    while (fetch_head == NULL && fetch_quit == 0)
+      pthread_cond_wait(&fetch_cond, &fetch_lock);
+
+    c = fetch_head;
+
+    if (c != NULL) {
+      fetch_head = c->fetch_next;
+
+      if (fetch_head == NULL)
+        fetch_tail = &fetch_head;
+    }
+
+    pthread_mutex_unlock(&fetch_lock);
+
+    if (c == NULL)
+      return NULL;
+
+    /* The loop thread leaves the client alone until it's handed back. */
+    f = c->file;
+    offset = c->offset;
+    end = offset + FILE_CHUNK;
+
+    if (end > f->size)
+      end = f->size;
+
+    while (offset < end) {
+      len = end - offset;
+
+      if (len > sizeof(buf))
+        len = sizeof(buf);
+
+      n = pread(f->fd, buf, len, offset);
+
+      if (n == -1 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        break; /* sendfile() will report it. */
+
+      offset += n;
+    }
+
+    faio_async_send(&fetch_async, &c->fetch_node);
+  }
+}
+
+static void fetch_cb(struct faio_loop *loop,
+                     struct faio_async *async,
+                     struct faio_async_node *nodes)
+{
+  struct faio_async_node *next;
+  struct client *c;
+
+  (void) async;
+
+  for (; nodes != NULL; nodes = next) {
+    next = nodes->next;
+    c = CONTAINER_OF(nodes, struct client, fetch_node);
+    c->fetching = 0;
+
+    if (c->closing)
+      client_free(c);
+    else if (client_write(loop, c))
+      client_destroy(loop, c);
+  }
+}
+
+static void fetch_push(struct client *c)
+{
+  c->fetching = 1;
+  c->fetch_next = NULL;
+
+  pthread_mutex_lock(&fetch_lock);
+  *fetch_tail = c;
+  fetch_tail = &c->fetch_next;
+  pthread_cond_signal(&fetch_cond);
+  pthread_mutex_unlock(&fetch_lock);
+}
+
+static int fetch_start(struct faio_loop *loop)
+{
+  if (faio_async_init(loop, &fetch_async, fetch_cb))
+    return -1;
+
+  errno = pthread_create(&fetch_thread, NULL, fetch_main, NULL);
+
+  if (errno)
+    return -1;
+
+  return 0;
+}
+
+static void fetch_stop(struct faio_loop *loop)
+{
+  pthread_mutex_lock(&fetch_lock);
+  fetch_quit = 1;
+  pthread_cond_signal(&fetch_cond);
+  pthread_mutex_unlock(&fetch_lock);
+
+  pthread_join(fetch_thread, NULL);
+  faio_async_close(loop, &fetch_async);
+}
+
+/* Collects the request line, the rest of the request only matters to
+ * client_parse().
+ */
+static void client_save_line(struct client *c,
+                             const char *buf,
+                             unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0; i < len && c->line_done == 0; i++) {
+    if (buf[i] == '\n')
+      c->line_done = 1;
+    else if (c->line_len < sizeof(c->line) - 1)
+      c->line[c->line_len++] = buf[i];
+  }
+}
+
+/* Maps "GET /path HTTP/1.1" to the file, or NULL if there's none. */
+static struct file *client_lookup(struct client *c)
+{
+  char *path;
+  char *end;
+
+  c->line[c->line_len] = '\0';
+  c->line_len = 0;
+  c->line_done = 0;
+
+  path = strchr(c->line, ' ');
+
+  if (path == NULL)
+    return NULL;
+
+  while (*path == ' ')
+    path++;
+
+  while (*path == '/')
+    path++;
+
+  end = path + strcspn(path, " ?\r");
+  *end = '\0';
+
+  /* Stay inside the document root. */
+  if (strstr(path, "..") != NULL)
+    return NULL;
+
+  return file_open(path);
+}
+
+static int client_queue_file(struct client *c)
+{
+  unsigned int pos;
+
+  /* More than that is a client that doesn't read its responses. */
+  if (c->pending >= FILE_PIPELINE)
+    return -1;
+
+  pos = (c->pipeline_head + c->pending) % FILE_PIPELINE;
+  c->pipeline[pos] = client_lookup(c);
+
+  return 0;
+}
+
+static void client_send_file_response(struct client *c, int keep_alive)
+{
+  const char *connection;
+  struct file *f;
+  int len;
+
+  connection = keep_alive ? "keep-alive" : "close";
+  f = c->pipeline[c->pipeline_head];
+  c->pipeline_head = (c->pipeline_head + 1) % FILE_PIPELINE;
+
+  if (f == NULL)
+    len = snprintf(c->header,
+                   sizeof(c->header),
+                   "HTTP/1.1 404 Not Found\r\n"
+                   "Content-Length: %u\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Connection: %s\r\n"
+                   "\r\n"
+                   "%s",
+                   (unsigned int) sizeof(not_found_body) - 1,
+                   connection,
+                   not_found_body);
+  else
+    len = snprintf(c->header,
+                   sizeof(c->header),
+                   "HTTP/1.1 200 OK\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Content-Type: application/octet-stream\r\n"
+                   "Connection: %s\r\n"
+                   "\r\n",
+                   (long long) f->size,
+                   connection);
+
+  assert(len > 0 && (size_t) len < sizeof(c->header));
+  faio_writeq_push(&c->wq, c->wbufs + c->nwbufs++, c->header, len, NULL);
+
+  c->file = f;
+  c->offset = 0;
+}
+
+/* Sends the file body with sendfile() once the headers are out. Cold
+ * chunks go to the fetch thread first, full socket buffers wait for
+ * FAIO_POLLOUT.
+ */
+static int client_send_file(struct faio_loop *loop, struct client *c)
+{
+  struct file *f;
+  size_t len;
+  ssize_t n;
+
+  f = c->file;
+
+  while (c->offset < f->size) {
+    len = f->size - c->offset;
+
+    if (len > FILE_CHUNK)
+      len = FILE_CHUNK;
+
+    if (!file_resident(f, c->offset, len)) {
+      /* No point in waking up for writability in the meantime. */
+      if (c->fh.events & FAIO_POLLOUT)
+        if (faio_mod(loop, &c->fh, FAIO_POLLIN))
+          return -1;
+
+      fetch_push(c);
+      return 0;
+    }
+
+    n = sendfile(c->fh.fd, f->fd, &c->offset, len);
+
+    if (n == -1 && errno == EINTR)
       continue;
+
+    if (n == -1 && errno == EAGAIN) {
+      if (c->fh.events & FAIO_POLLOUT)
+        return 0;
+
+      return faio_mod(loop, &c->fh, FAIO_POLLIN | FAIO_POLLOUT);
     }
 
-    if (ch != '\n')
-      ps = ps_new;
-    else if (ps != ps_eol)
-      ps = ps_eol;
-    else if (i + 1 == len)
-      ps = ps_eol_2;
-    else
-      return -1;
+    if (n <= 0)
+      return -1; /* Error or the file shrank. */
   }
 
-  c->ps = ps;
+  c->file = NULL;
+
+  if (c->fh.events & FAIO_POLLOUT)
+    return faio_mod(loop, &c->fh, FAIO_POLLIN);
 
   return 0;
 }
 
-static void client_send_response(struct client *c)
+#endif /* defined(BENCH_STATIC) */
+
+static void large_response_init(size_t size)
 {
-  if (c->keep_alive) {
-    c->wr.buf = keepalive_response;
-    c->wr.len = sizeof(keepalive_response) - 1;
+  unsigned int i;
+  int n;
+
+  large_body = malloc(size > 0 ? size : 1);
+
+  if (large_body == NULL)
+    sys_error("malloc");
+
+  memset(large_body, 'x', size);
+  large_len = size;
+
+  for (i = 0; i < ARRAY_SIZE(large_headers); i++) {
+    n = snprintf(large_headers[i],
+                 sizeof(large_headers[i]),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Content-Type: text/plain\r\n"
+                 "Connection: %s\r\n"
+                 "\r\n",
+                 (unsigned long) size,
+                 i ? "keep-alive" : "close");
+    large_headers_len[i] = n;
   }
-  else {
-    c->wr.buf = connection_close_response;
-    c->wr.len = sizeof(connection_close_response) - 1;
+}
+
+/* Queues responses to as many of the pending requests as there are free
+ * buffers for. Keep-alive responses to the plain requests go out in one
+ * buffer per batch, the writev() in the flush gathers the rest.
+ */
+static void client_queue_responses(struct client *c)
+{
+  struct faio_wbuf *buf;
+  unsigned int n;
+  int keep_alive;
+
+  while (c->pending > 0 && c->nwbufs < ARRAY_SIZE(c->wbufs)) {
+    keep_alive = c->pending > 1 || c->last_request == 0;
+    buf = c->wbufs + c->nwbufs;
+
+#if defined(BENCH_STATIC)
+    /* One at a time, the body follows the headers with sendfile(). */
+    if (root_fd != -1) {
+      if (c->nwbufs > 0 || c->file != NULL || c->fetching)
+        return;
+
+      client_send_file_response(c, keep_alive);
+      c->pending--;
+      continue;
+    }
+#endif
+
+    if (large_body != NULL) {
+      if (c->nwbufs + 2 > ARRAY_SIZE(c->wbufs))
+        return;
+
+      faio_writeq_push(&c->wq,
+                       buf,
+                       large_headers[keep_alive],
+                       large_headers_len[keep_alive],
+                       NULL);
+      faio_writeq_push(&c->wq, buf + 1, large_body, large_len, NULL);
+      c->nwbufs += 2;
+      c->pending--;
+      continue;
+    }
+
+    if (!keep_alive) {
+      faio_writeq_push(&c->wq,
+                       buf,
+                       connection_close_response,
+                       sizeof(connection_close_response) - 1,
+                       NULL);
+      c->nwbufs++;
+      c->pending--;
+      continue;
+    }
+
+    n = c->pending - c->last_request;
+
+    if (n > RESPONSE_BATCH)
+      n = RESPONSE_BATCH;
+
+    faio_writeq_push(&c->wq,
+                     buf,
+                     keepalive_batch,
+                     n * (sizeof(keepalive_response) - 1),
+                     NULL);
+    c->nwbufs++;
+    c->pending -= n;
   }
 }
 
+static int client_write(struct faio_loop *loop, struct client *c);
+
+/* Reads and parses everything that's there before answering, so that
+ * pipelined requests are answered with one write.
+ */
 static int client_read(struct faio_loop *loop, struct client *c)
 {
   char buf[1024];
   ssize_t n;
 
   do {
-    assert(c->ps != ps_error);
-
     do
       n = read(c->fh.fd, buf, sizeof(buf));
     while (n == -1 && errno == EINTR);
 
     if (n == -1) {
       assert(errno == EAGAIN);
-      return 0;
+      break;
     }
 
     if (n == 0)
       return -1; /* Connection closed by peer. */
 
-    if (client_parse(c, buf, n))
+    if (client_consume(c, buf, n))
       return -1;
-
-    if (c->ps == ps_eol_2) {
-      client_send_response(c);
-      return faio_mod(loop, &c->fh, FAIO_POLLOUT);
-    }
   }
   while (n == sizeof(buf));
 
-  return 0;
+  return client_write(loop, c);
 }
 
+/* Writes right away, FAIO_POLLOUT only comes into play when the socket
+ * buffer is full.
+ */
 static int client_write(struct faio_loop *loop, struct client *c)
 {
-  ssize_t n;
+  int r;
 
-  do {
-    assert(c->wr.buf != NULL);
-    assert(c->wr.len != 0);
+  for (;;) {
+    client_queue_responses(c);
 
-    do
-      n = write(c->fh.fd, c->wr.buf, c->wr.len);
-    while (n == 0 && errno == EINTR);
+#if defined(BENCH_STATIC)
+    /* The body follows with sendfile(), let the headers wait for it. */
+    if (c->file != NULL)
+      r = faio_writeq_flush_more(loop, &c->wq);
+    else
+#endif
+      r = faio_writeq_flush(loop, &c->wq);
 
-    if (n == -1) {
-      assert(errno == EAGAIN);
+    if (r)
+      return -1;
+
+    /* The queue waits for FAIO_POLLOUT or the release of its zero-copy
+     * buffers, and calls us again.
+     */
+    if (!faio_writeq_empty(&c->wq))
       return 0;
-    }
 
-    if (n == 0)
-      return -1; /* Connection closed by peer. */
+    c->nwbufs = 0;
 
-    c->wr.buf = (const char *) c->wr.buf + n;
-    c->wr.len -= n;
-  }
-  while (c->wr.len != 0);
+#if defined(BENCH_STATIC)
+    if (c->fetching)
+      return 0;
 
-  if (c->keep_alive == 0)
-    return -1;
+    if (c->file != NULL) {
+      if (client_send_file(loop, c))
+        return -1;
 
-  c->keep_alive = 0;
-  return faio_mod(loop, &c->fh, FAIO_POLLIN);
+      if (c->file != NULL)
+        return 0;
+    }
+#endif
+
+    if (c->pending == 0)
+      return c->last_request ? -1 : 0;
+  }
 }
 
 static void client_cb(struct faio_loop *loop,
@@ -300,9 +1063,16 @@ static void client_cb(struct faio_loop *loop,
 {
   struct client *c = CONTAINER_OF(fh, struct client, fh);
 
-  if (revents & (FAIO_POLLERR | FAIO_POLLHUP))
+  if (revents & FAIO_POLLHUP)
     goto err;
 
+  /* Zero-copy completions arrive as errors. Carry on with the responses
+   * once the kernel has released their buffers.
+   */
+  if (revents & FAIO_POLLERR)
+    if (faio_writeq_reap(loop, &c->wq) || client_write(loop, c))
+      goto err;
+
   if (revents & FAIO_POLLIN)
     if (client_read(loop, c))
       goto err;
@@ -314,41 +1084,202 @@ static void client_cb(struct faio_loop *loop,
   return;
 
 err:
-  faio_del(loop, fh);
-  close(c->fh.fd);
-  free(c);
+  client_destroy(loop, c);
+}
+
+static void client_destroy(struct faio_loop *loop, struct client *c)
+{
+  faio_writeq_cancel(loop, &c->wq);
+  faio_close(loop, &c->fh);
+
+#if defined(BENCH_STATIC)
+  /* Still in the fetch thread's hands, fetch_cb() frees it. */
+  if (c->fetching) {
+    c->closing = 1;
+    return;
+  }
+#endif
+
+  client_free(c);
 }
 
 static void accept_cb(struct faio_loop *loop,
-                      struct faio_handle *fh,
-                      unsigned int revents)
+                      struct faio_listener *listener,
+                      int fd)
 {
+#if defined(BENCH_STATIC)
+  static const int on = 1;
+#endif
   struct client *c;
-  int fd;
 
-  assert(revents == FAIO_POLLIN);
+  (void) listener;
 
-  while (-1 != (fd = nb_accept(fh->fd, NULL, NULL))) {
-    c = calloc(1, sizeof(*c));
+  /* Out of file descriptors, the listener dropped the connections that
+   * were waiting. Raise the limit with ulimit -n.
+   */
+  if (fd < 0)
+    return;
 
-    if (c == NULL)
-      abort();
+  c = client_alloc();
 
-    if (faio_add(loop, &c->fh, client_cb, fd, FAIO_POLLIN))
-      abort();
-  }
+  if (c == NULL)
+    abort();
+
+  memset(c, 0, sizeof(*c));
+
+  /* With BENCH_THREADS, another thread can dispatch the client as soon as
+   * it's added. Set up the write queue first; faio_writeq_zerocopy() wants
+   * the fd already.
+   */
+  c->fh.fd = fd;
+  faio_writeq_init(&c->wq, &c->fh);
+
+  if (zerocopy_threshold != 0)
+    if (faio_writeq_zerocopy(&c->wq, zerocopy_threshold))
+      sys_error("faio_writeq_zerocopy");
+
+#if defined(BENCH_STATIC)
+  /* The headers and the sendfile() body are separate segments, don't let
+   * Nagle hold back the body until the headers are acked.
+   */
+  if (root_fd != -1)
+    E(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)));
+#endif
+
+  if (faio_add(loop, &c->fh, client_cb, fd, FAIO_POLLIN))
+    abort();
+}
 
-  assert(errno == EAGAIN);
+#endif /* defined(BENCH_COMPLETION) */
+
+static int quit;
+
+static void print_stats(struct faio_loop *loop)
+{
+  struct faio_stats stats;
+
+  /* Only available when compiled with -DFAIO_STATS. */
+  if (faio_stats_snapshot(loop, &stats))
+    return;
+
+  fprintf(stderr,
+          "polls: %llu (%llu empty, %llu full)\n"
+          "events: %llu, callbacks: %llu, pending replays: %llu\n"
+          "budget carryovers: %llu\n"
+          "blocked: %.3f s, dispatching: %.3f s\n",
+          (unsigned long long) stats.polls,
+          (unsigned long long) stats.polls_empty,
+          (unsigned long long) stats.polls_full,
+          (unsigned long long) stats.events,
+          (unsigned long long) stats.callbacks,
+          (unsigned long long) stats.pending_replays,
+          (unsigned long long) stats.budget_carryovers,
+          stats.blocked_ns / 1e9,
+          stats.callback_ns / 1e9);
+}
+
+/* ru_maxrss is in kilobytes, except on Darwin where it's in bytes. */
+static void print_rusage(void)
+{
+  struct rusage ru;
+
+  E(getrusage(RUSAGE_SELF, &ru));
+  fprintf(stderr,
+          "rusage: maxrss %ld, user %ld.%06ld s, system %ld.%06ld s, "
+          "nvcsw %ld, nivcsw %ld\n",
+          ru.ru_maxrss,
+          (long) ru.ru_utime.tv_sec,
+          (long) ru.ru_utime.tv_usec,
+          (long) ru.ru_stime.tv_sec,
+          (long) ru.ru_stime.tv_usec,
+          ru.ru_nvcsw,
+          ru.ru_nivcsw);
+}
+
+static void busy_poll_stats_cb(struct faio_loop *loop,
+                               struct faio_timer *timer)
+{
+  uint64_t spin_wakeups;
+  uint64_t block_wakeups;
+
+  faio_busy_poll_stats(loop, &spin_wakeups, &block_wakeups);
+  fprintf(stderr,
+          "busy poll: %llu wakeups while spinning, %llu after blocking\n",
+          (unsigned long long) spin_wakeups,
+          (unsigned long long) block_wakeups);
+
+  faio_timer_start(loop, timer, busy_poll_stats_cb, 5);
+}
+
+static void slow_callback_cb(struct faio_loop *loop,
+                             const struct faio_slow_callback *slow)
+{
+  (void) loop;
+  fprintf(stderr,
+          "slow callback: fd %d took %llu us\n",
+          slow->fd,
+          (unsigned long long) slow->duration_ns / 1000);
+}
+
+/* BENCH_THREADS mode. Wakes up every second to check |quit|, the signal
+ * is only delivered to one of the threads.
+ */
+static void *poll_main(void *arg)
+{
+  struct faio_loop *loop = arg;
+
+  while (!__atomic_load_n(&quit, __ATOMIC_RELAXED))
+    faio_poll(loop, 1);
+
+  return NULL;
+}
+
+static void quit_cb(struct faio_loop *loop,
+                    struct faio_signal *sig,
+                    int signum)
+{
+  (void) loop;
+  (void) sig;
+  (void) signum;
+  __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
 }
 
 int main(void)
 {
-  struct faio_handle server_handle;
+#if !defined(BENCH_COMPLETION)
+  struct faio_listener server_listener;
+  unsigned int accept_flags;
+  const char *listen_priority;
+  const char *accept_batch;
+#endif
+  struct faio_signal sigterm;
+  struct faio_signal sigint;
+  struct faio_timer stats_timer;
   struct faio_loop main_loop;
+  pthread_t *threads;
+  const char *busy_poll;
+  const char *watchdog;
+  const char *budget;
+  const char *usecs;
+  const char *prewarm;
+  const char *nthreads_env;
+#if !defined(BENCH_COMPLETION)
+  const char *response_size;
+  const char *zerocopy;
+#endif
+#if defined(BENCH_STATIC)
+  const char *root;
+#endif
+  unsigned int i;
   int server_fd;
 
   E(signal(SIGPIPE, SIG_IGN));
 
+  for (i = 0; i < RESPONSE_BATCH; i++)
+    memcpy(keepalive_batch + i * (sizeof(keepalive_response) - 1),
+           keepalive_response,
+           sizeof(keepalive_response) - 1);
+
   server_fd = create_server(1234);
   if (server_fd == -1)
     abort();
@@ -356,11 +1287,190 @@ int main(void)
   if (faio_init(&main_loop))
     abort();
 
-  if (faio_add(&main_loop, &server_handle, accept_cb, server_fd, FAIO_POLLIN))
+  /* BENCH_THREADS=<n> runs n threads on the one loop instead of one. */
+  nthreads_env = getenv("BENCH_THREADS");
+
+  if (nthreads_env != NULL && atoi(nthreads_env) > 1) {
+    if (faio_set_shared(&main_loop))
+      sys_error("faio_set_shared");
+
+    nthreads = atoi(nthreads_env);
+  }
+
+  /* BENCH_PREWARM=<clients> maps and faults in memory for that many
+   * clients up front.
+   */
+  prewarm = getenv("BENCH_PREWARM");
+
+  if (faio_slab_init(&main_loop,
+                     &clients,
+                     sizeof(struct client),
+                     prewarm ? atoi(prewarm) : 0))
+  {
     abort();
+  }
+
+  memset(&sigterm, 0, sizeof(sigterm));
+  memset(&sigint, 0, sizeof(sigint));
+
+  if (faio_signal_start(&main_loop, &sigterm, quit_cb, SIGTERM))
+    abort();
+
+  if (faio_signal_start(&main_loop, &sigint, quit_cb, SIGINT))
+    abort();
+
+  /* BENCH_WATCHDOG=<usecs> reports callbacks that take longer. */
+  watchdog = getenv("BENCH_WATCHDOG");
+
+  if (watchdog != NULL)
+    faio_set_watchdog(&main_loop,
+                      slow_callback_cb,
+                      strtoull(watchdog, NULL, 10) * 1000,
+                      1);
+
+  /* BENCH_BUDGET=<callbacks>[,<usecs>] limits the work per iteration. */
+  budget = getenv("BENCH_BUDGET");
+
+  if (budget != NULL) {
+    usecs = strchr(budget, ',');
+    faio_set_budget(&main_loop,
+                    strtoul(budget, NULL, 10),
+                    usecs ? strtoull(usecs + 1, NULL, 10) * 1000 : 0);
+  }
+
+  /* BENCH_BUSY_POLL=<usecs> enables busy polling. */
+  busy_poll = getenv("BENCH_BUSY_POLL");
+
+  if (busy_poll != NULL) {
+    if (faio_set_busy_poll(&main_loop, atoi(busy_poll)))
+      abort();
+
+    memset(&stats_timer, 0, sizeof(stats_timer));
+    faio_timer_start(&main_loop, &stats_timer, busy_poll_stats_cb, 5);
+  }
+
+#if !defined(BENCH_COMPLETION)
+  /* BENCH_RESPONSE_SIZE=<bytes> replaces the canned body with one of that
+   * size. BENCH_ZEROCOPY=<bytes> sends batches of at least that many
+   * bytes with MSG_ZEROCOPY.
+   */
+  response_size = getenv("BENCH_RESPONSE_SIZE");
+
+  if (response_size != NULL)
+    large_response_init(strtoul(response_size, NULL, 10));
+
+  zerocopy = getenv("BENCH_ZEROCOPY");
+
+  if (zerocopy != NULL)
+    zerocopy_threshold = strtoul(zerocopy, NULL, 10);
+#endif
+
+#if defined(BENCH_STATIC)
+  /* BENCH_ROOT=<dir> serves the files in that directory instead of the
+   * canned response.
+   */
+  root = getenv("BENCH_ROOT");
+
+  /* fetch_cb() writes to clients that another thread can be reading
+   * from at the same time.
+   */
+  if (root != NULL && nthreads > 1) {
+    fprintf(stderr, "BENCH_ROOT doesn't work with BENCH_THREADS\n");
+    abort();
+  }
+
+  if (root != NULL) {
+    E(root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    E(page_size = sysconf(_SC_PAGESIZE));
+
+    if (fetch_start(&main_loop))
+      sys_error("fetch_start");
+  }
+#endif
+
+#if defined(BENCH_COMPLETION)
+  E(accept_spare = open("/dev/null", O_RDONLY | O_CLOEXEC));
+  memset(&server_req, 0, sizeof(server_req));
+
+  if (faio_accept(&main_loop, &server_req, accept_cb, server_fd))
+    abort();
+#else
+  /* BENCH_ACCEPT_BATCH=<n> caps the connections accepted per iteration.
+   * BENCH_DEFER_ACCEPT=1 and BENCH_EXCLUSIVE=1 set the listener flags of
+   * the same names.
+   */
+  accept_batch = getenv("BENCH_ACCEPT_BATCH");
+  accept_flags = 0;
+
+  if (getenv("BENCH_DEFER_ACCEPT") != NULL)
+    accept_flags |= FAIO_LISTEN_DEFER;
+
+  if (getenv("BENCH_EXCLUSIVE") != NULL)
+    accept_flags |= FAIO_LISTEN_EXCLUSIVE;
+
+  if (faio_listener_start(&main_loop,
+                          &server_listener,
+                          accept_cb,
+                          server_fd,
+                          accept_batch ? atoi(accept_batch) : 0,
+                          accept_flags))
+  {
+    sys_error("faio_listener_start");
+  }
+
+  /* BENCH_LISTEN_PRIORITY=<0-2>, 0 dispatches the listen socket before
+   * the clients and 2 after them. Most useful together with BENCH_BUDGET.
+   */
+  listen_priority = getenv("BENCH_LISTEN_PRIORITY");
+
+  if (listen_priority != NULL)
+    if (faio_set_priority(&main_loop,
+                          &server_listener.handle,
+                          atoi(listen_priority)))
+    {
+      sys_error("faio_set_priority");
+    }
+#endif
+
+  threads = NULL;
+
+  if (nthreads > 1) {
+    threads = calloc(nthreads - 1, sizeof(*threads));
+
+    if (threads == NULL)
+      abort();
+
+    for (i = 0; i < nthreads - 1; i++) {
+      errno = pthread_create(&threads[i], NULL, poll_main, &main_loop);
+
+      if (errno)
+        sys_error("pthread_create");
+    }
+  }
+
+  while (!__atomic_load_n(&quit, __ATOMIC_RELAXED))
+    faio_poll(&main_loop, nthreads > 1 ? 1 : -1);
+
+  if (threads != NULL) {
+    for (i = 0; i < nthreads - 1; i++)
+      pthread_join(threads[i], NULL);
+
+    free(threads);
+  }
+
+  if (busy_poll != NULL)
+    busy_poll_stats_cb(&main_loop, &stats_timer);
+
+  print_stats(&main_loop);
+
+  /* BENCH_RUSAGE=1 prints resource usage, see bench-suite.sh. */
+  if (getenv("BENCH_RUSAGE") != NULL)
+    print_rusage();
 
-  for (;;)
-    faio_poll(&main_loop, -1);
+#if defined(BENCH_STATIC)
+  if (root_fd != -1)
+    fetch_stop(&main_loop);
+#endif
 
   faio_fini(&main_loop);
   close(server_fd);
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_ASYNC_H_
+#define FAIO_ASYNC_H_
+
+#include "faio-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+/* Cross-thread wakeups. Producers push nodes onto a lock-free LIFO with a
+ * single compare-and-swap, the loop takes the whole list with one exchange
+ * and reverses it. All async handles of a loop share one eventfd (a pipe
+ * on other platforms) that is only written to when the loop is blocked
+ * in the kernel and nobody else has woken it up yet. A loop that's busy
+ * dispatching callbacks checks for pending work before it blocks again.
+ */
+struct faio_async_node
+{
+  struct faio_async_node *next;
+};
+
+struct faio__asyncs
+{
+  struct faio__queue queue; /* All struct faio_async handles. */
+  int pending;              /* An async handle has pending work. */
+  int polling;              /* Loop is blocked or about to block. */
+  int woken;                /* Wakeup written but not yet consumed. */
+  int shared;               /* Several threads may be blocked. */
+  int fds[2];               /* Same fd twice if it's an eventfd. */
+};
+
+struct faio_async
+{
+  struct faio__queue queue;
+  void (*cb)(struct faio_loop *,
+             struct faio_async *,
+             struct faio_async_node *);
+  struct faio__asyncs *asyncs;
+  struct faio_async_node *head;
+  int pending; /* FAIO__ASYNC_PENDING | FAIO__ASYNC_NULL */
+};
+
+#define FAIO__ASYNC_PENDING 1
+#define FAIO__ASYNC_NULL 2 /* A NULL node was sent. */
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__asyncs_init(struct faio__asyncs *a)
+{
+  faio__queue_init(&a->queue);
+  a->pending = 0;
+  a->polling = 0;
+  a->woken = 0;
+  a->shared = 0;
+  a->fds[0] = -1;
+  a->fds[1] = -1;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__asyncs_open(struct faio__asyncs *a)
+{
+  int fd;
+
+#if defined(__linux__)
+  fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (fd == -1)
+    return -1;
+
+  a->fds[0] = fd;
+  a->fds[1] = fd;
+#else
+  if (pipe(a->fds))
+    return -1;
+
+  for (fd = 0; fd < 2; fd++) {
+    fcntl(a->fds[fd], F_SETFD, FD_CLOEXEC);
+    fcntl(a->fds[fd], F_SETFL, fcntl(a->fds[fd], F_GETFL) | O_NONBLOCK);
+  }
+#endif
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__asyncs_fini(struct faio__asyncs *a)
+{
+  if (a->fds[0] != -1)
+    close(a->fds[0]);
+
+  if (a->fds[1] != -1 && a->fds[1] != a->fds[0])
+    close(a->fds[1]);
+
+  a->fds[0] = -1;
+  a->fds[1] = -1;
+}
+
+/* Called by the loop when the wakeup fd is readable. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__asyncs_drain_fd(struct faio__asyncs *a)
+{
+  char buf[64];
+
+  while (read(a->fds[0], buf, sizeof(buf)) == sizeof(buf));
+
+  /* Only after draining. Clearing it first lets a producer write in
+   * between, the read eats the write and |woken| stays set with nothing
+   * in the fd, suppressing all later wakeups. This way a racing write
+   * just causes a spurious wakeup.
+   */
+  __atomic_store_n(&a->woken, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Called by the loop right before it blocks. Returns nonzero if there is
+ * pending work and the loop shouldn't block. Pairs with faio_async_send().
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio__asyncs_before_wait(struct faio__asyncs *a)
+{
+  if (faio__queue_empty(&a->queue))
+    return 0;
+
+  __atomic_store_n(&a->polling, 1, __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&a->pending, __ATOMIC_SEQ_CST);
+}
+
+/* Lockless check for pending work, for use while busy polling. */
+FAIO_ATTRIBUTE_UNUSED
+static int faio__asyncs_pending(struct faio__asyncs *a)
+{
+  return __atomic_load_n(&a->pending, __ATOMIC_RELAXED);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__asyncs_after_wait(struct faio__asyncs *a)
+{
+  __atomic_store_n(&a->polling, 0, __ATOMIC_RELAXED);
+}
+
+/* Invoke the callbacks of the async handles with pending work. Returns 1
+ * if any callbacks were invoked, 0 otherwise.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio__asyncs_run(struct faio_loop *loop, struct faio__asyncs *a)
+{
+  struct faio_async_node *nodes;
+  struct faio_async_node *node;
+  struct faio_async_node *next;
+  struct faio_async *async;
+  struct faio__queue *queue;
+  struct faio__queue list;
+  int pending;
+  int ran;
+
+  if (__atomic_load_n(&a->pending, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  __atomic_store_n(&a->pending, 0, __ATOMIC_SEQ_CST);
+
+  ran = 0;
+
+  /* Callbacks may close async handles, including ones we haven't visited
+   * yet. Walk a detached list and put handles back as we go.
+   */
+  faio__queue_move(&a->queue, &list);
+
+  while (!faio__queue_empty(&list)) {
+    queue = faio__queue_head(&list);
+    faio__queue_remove(queue);
+    faio__queue_append(&a->queue, queue);
+    async = faio__queue_data(queue, struct faio_async, queue);
+
+    pending = __atomic_exchange_n(&async->pending, 0, __ATOMIC_SEQ_CST);
+
+    if (pending == 0)
+      continue;
+
+    node = __atomic_exchange_n(&async->head, NULL, __ATOMIC_ACQUIRE);
+
+    /* A producer that pushed its node after we cleared |pending| last time
+     * but before we took |head| already had it delivered. Don't report an
+     * empty batch unless somebody actually sent NULL.
+     */
+    if (node == NULL && (pending & FAIO__ASYNC_NULL) == 0)
+      continue;
+
+    /* Producers push in LIFO order, reverse to get them in FIFO order. */
+    for (nodes = NULL; node != NULL; node = next) {
+      next = node->next;
+      node->next = nodes;
+      nodes = node;
+    }
+
+    async->cb(loop, async, nodes);
+    ran = 1;
+  }
+
+  return ran;
+}
+
+/* Thread-safe. Queues |node| (can be NULL) and wakes up the loop if
+ * necessary. Calls made before the loop gets around to invoking the
+ * callback are coalesced into a single callback.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_async_send(struct faio_async *async,
+                            struct faio_async_node *node)
+{
+  struct faio__asyncs *a;
+  uint64_t one;
+  int flag;
+
+  flag = FAIO__ASYNC_PENDING;
+
+  if (node == NULL)
+    flag |= FAIO__ASYNC_NULL;
+  else {
+    node->next = __atomic_load_n(&async->head, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&async->head,
+                                        &node->next,
+                                        node,
+                                        1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+  }
+
+  /* Somebody else already flagged it and the loop hasn't drained it yet. */
+  if (__atomic_fetch_or(&async->pending, flag, __ATOMIC_SEQ_CST))
+    return;
+
+  a = async->asyncs;
+  __atomic_store_n(&a->pending, 1, __ATOMIC_SEQ_CST);
+
+  /* The loop is busy, it will see the pending flag before it blocks. */
+  if (__atomic_load_n(&a->polling, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  /* In shared mode one thread's wakeup says nothing about the others. */
+  if (!a->shared && __atomic_exchange_n(&a->woken, 1, __ATOMIC_SEQ_CST))
+    return;
+
+  one = 1;
+
+  while (write(a->fds[1], &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+#endif /* FAIO_ASYNC_H_ */
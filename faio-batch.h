@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_BATCH_H_
+#define FAIO_BATCH_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Storage for the events that the backend fetches from the kernel in one
+ * go. The size is either fixed or adaptive. In adaptive mode the batch
+ * doubles after FAIO__BATCH_GROW full batches in a row and halves after
+ * FAIO__BATCH_SHRINK batches in a row that are less than a quarter full.
+ */
+#define FAIO__BATCH_DEFAULT 256
+#define FAIO__BATCH_MIN     64
+#define FAIO__BATCH_MAX     65536
+#define FAIO__BATCH_GROW    2
+#define FAIO__BATCH_SHRINK  64
+
+struct faio__batch
+{
+  void *events;          /* NULL if the backend doesn't need storage. */
+  size_t elsize;
+  unsigned int size;
+  unsigned int adaptive;
+  unsigned int full;     /* Consecutive full batches. */
+  unsigned int sparse;   /* Consecutive sparse batches. */
+  uint64_t full_batches; /* Total number of full batches. */
+};
+
+static int faio__batch_resize(struct faio__batch *b, unsigned int size)
+{
+  void *events;
+
+  if (b->elsize != 0) {
+    events = realloc(b->events, size * b->elsize);
+
+    if (events == NULL)
+      return -1;
+
+    b->events = events;
+  }
+
+  b->size = size;
+  b->full = 0;
+  b->sparse = 0;
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__batch_init(struct faio__batch *b, size_t elsize)
+{
+  b->events = NULL;
+  b->elsize = elsize;
+  b->adaptive = 0;
+  b->full_batches = 0;
+
+  return faio__batch_resize(b, FAIO__BATCH_DEFAULT);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__batch_fini(struct faio__batch *b)
+{
+  free(b->events);
+  b->events = NULL;
+}
+
+/* A |size| of zero selects adaptive mode. */
+FAIO_ATTRIBUTE_UNUSED
+static int faio__batch_set(struct faio__batch *b, unsigned int size)
+{
+  if (size > FAIO__BATCH_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (size == 0) {
+    b->adaptive = 1;
+    return 0;
+  }
+
+  if (faio__batch_resize(b, size))
+    return -1;
+
+  b->adaptive = 0;
+
+  return 0;
+}
+
+/* Record that the kernel returned |n| events. Must not be called while the
+ * events are still being dispatched, the storage may move.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__batch_update(struct faio__batch *b, unsigned int n)
+{
+  if (n == b->size) {
+    b->full_batches++;
+    b->sparse = 0;
+
+    if (b->adaptive && ++b->full >= FAIO__BATCH_GROW)
+      if (b->size < FAIO__BATCH_MAX)
+        faio__batch_resize(b, b->size * 2);
+
+    return;
+  }
+
+  b->full = 0;
+
+  if (n >= b->size / 4) {
+    b->sparse = 0;
+    return;
+  }
+
+  if (b->adaptive && ++b->sparse >= FAIO__BATCH_SHRINK)
+    if (b->size > FAIO__BATCH_MIN)
+      faio__batch_resize(b, b->size / 2);
+}
+
+#endif /* FAIO_BATCH_H_ */
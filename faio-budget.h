@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_BUDGET_H_
+#define FAIO_BUDGET_H_
+
+#include "faio-busy.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+/* Dispatch budget: how many handle callbacks one faio_poll() call makes
+ * and how much time it spends on them. Without one, a loop that keeps
+ * getting full batches keeps polling and dispatching, and timers and the
+ * caller's own work wait until the burst is over.
+ *
+ * The backend still fetches whole batches when the budget runs out. The
+ * handles that it can't dispatch go on the pending queue, behind the ones
+ * that are already there, and are dispatched first in the next call. The
+ * time budget costs a clock_gettime() per callback and is only checked
+ * when it is set.
+ */
+struct faio__budget
+{
+  unsigned int events; /* Callbacks per call, zero is unlimited. */
+  uint64_t ns;         /* Nanoseconds per call, zero is unlimited. */
+  unsigned int left;   /* Callbacks left in the current call. */
+  uint64_t deadline;   /* When the current call runs out of time. */
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__budget_init(struct faio__budget *b)
+{
+  b->events = 0;
+  b->ns = 0;
+  b->left = UINT_MAX;
+  b->deadline = UINT64_MAX;
+}
+
+/* Start of a faio_poll() call. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__budget_begin(struct faio__budget *b)
+{
+  b->left = b->events != 0 ? b->events : UINT_MAX;
+  b->deadline = UINT64_MAX;
+
+  if (b->ns != 0)
+    b->deadline = faio__busy_hrtime() + b->ns;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__budget_spent(const struct faio__budget *b)
+{
+  return b->left == 0;
+}
+
+/* Account for one callback. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__budget_charge(struct faio__budget *b)
+{
+  if (b->events != 0)
+    b->left--;
+
+  if (b->ns != 0 && b->left != 0)
+    if (faio__busy_hrtime() >= b->deadline)
+      b->left = 0;
+}
+
+#endif /* FAIO_BUDGET_H_ */
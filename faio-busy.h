@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_BUSY_H_
+#define FAIO_BUSY_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Busy polling: before the loop blocks in the kernel, it polls without
+ * blocking for up to |usecs| microseconds. That trades a core for the cost
+ * of going to sleep and being woken up again. Async handles are checked
+ * while spinning so faio_async_send() doesn't need to write to the wakeup
+ * fd either.
+ */
+struct faio__busy
+{
+  unsigned int usecs;      /* Spin budget, zero if disabled. */
+  uint64_t spin_wakeups;   /* Events found while spinning. */
+  uint64_t block_wakeups;  /* Events found after blocking. */
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__busy_init(struct faio__busy *b)
+{
+  b->usecs = 0;
+  b->spin_wakeups = 0;
+  b->block_wakeups = 0;
+}
+
+/* Returns the current time in nanoseconds. */
+FAIO_ATTRIBUTE_UNUSED
+static uint64_t faio__busy_hrtime(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the point in time, in nanoseconds, when the loop should stop
+ * spinning, taking the poll timeout |ns| into account. Returns 0 if it
+ * shouldn't spin at all.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static uint64_t faio__busy_deadline(const struct faio__busy *b, int64_t ns)
+{
+  uint64_t budget;
+
+  if (b->usecs == 0 || ns == 0)
+    return 0;
+
+  budget = b->usecs * 1000ULL;
+
+  if (ns > 0 && budget > (uint64_t) ns)
+    budget = ns;
+
+  return faio__busy_hrtime() + budget;
+}
+
+#endif /* FAIO_BUSY_H_ */
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Functionality that is built on top of the backend primitives. Every
+ * backend's struct faio_loop has the same |timers|, |asyncs|,
+ * |async_handle|, |signals| and |signal_handle| members.
+ */
+
+#ifndef FAIO_COMMON_H_
+#define FAIO_COMMON_H_
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_poll(struct faio_loop *loop, double timeout)
+{
+  /* Anything longer than INT64_MAX nanoseconds (292 years) is forever. */
+  if (timeout < 0 || timeout >= 9.2e9)
+    faio_poll_ns(loop, -1);
+  else
+    faio_poll_ns(loop, (int64_t) (timeout * 1e9));
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_timer_start(struct faio_loop *loop,
+                             struct faio_timer *timer,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_timer *timer),
+                             double timeout)
+{
+#if defined(FAIO__SHARED)
+  faio__shared_timers_lock(loop);
+  faio__timers_start(&loop->timers, timer, cb, timeout);
+  faio__shared_timers_unlock(loop);
+#else
+  faio__timers_start(&loop->timers, timer, cb, timeout);
+#endif
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_timer_stop(struct faio_loop *loop, struct faio_timer *timer)
+{
+#if defined(FAIO__SHARED)
+  faio__shared_timers_lock(loop);
+  faio__timers_stop(timer);
+  faio__shared_timers_unlock(loop);
+#else
+  (void) loop;
+  faio__timers_stop(timer);
+#endif
+}
+
+static void faio__async_io(struct faio_loop *loop,
+                           struct faio_handle *handle,
+                           unsigned int revents)
+{
+  (void) handle;
+  (void) revents;
+  faio__asyncs_drain_fd(&loop->asyncs);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_async_init(struct faio_loop *loop,
+                           struct faio_async *async,
+                           void (*cb)(struct faio_loop *loop,
+                                      struct faio_async *async,
+                                      struct faio_async_node *nodes))
+{
+  struct faio__asyncs *a;
+
+  a = &loop->asyncs;
+
+  /* The wakeup fd is created when the first async handle is. */
+  if (a->fds[0] == -1) {
+    if (faio__asyncs_open(a))
+      return -1;
+
+    if (faio_add(loop,
+                 &loop->async_handle,
+                 faio__async_io,
+                 a->fds[0],
+                 FAIO_POLLIN))
+    {
+      faio__asyncs_fini(a);
+      return -1;
+    }
+  }
+
+  async->cb = cb;
+  async->asyncs = a;
+  async->head = NULL;
+  async->pending = 0;
+  faio__queue_append(&a->queue, &async->queue);
+
+  return 0;
+}
+
+/* Not thread-safe. Producers must be done with |async| at this point. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_async_close(struct faio_loop *loop, struct faio_async *async)
+{
+  (void) loop;
+  faio__queue_remove(&async->queue);
+}
+
+static void faio__signal_io(struct faio_loop *loop,
+                            struct faio_handle *handle,
+                            unsigned int revents)
+{
+  (void) handle;
+  (void) revents;
+  faio__signals_run(loop, &loop->signals);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_signal_stop(struct faio_loop *loop,
+                             struct faio_signal *sig)
+{
+  /* Zeroed handles have never been started. */
+  if (sig->queue.prev == NULL || faio__queue_empty(&sig->queue))
+    return;
+
+  faio__queue_remove(&sig->queue);
+
+  if (!faio__signals_watched(&loop->signals, sig->signum))
+    faio__signals_unwatch(&loop->signals, sig->signum);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_signal_start(struct faio_loop *loop,
+                             struct faio_signal *sig,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_signal *sig,
+                                        int signum),
+                             int signum)
+{
+  struct faio__signals *s;
+
+  s = &loop->signals;
+
+  /* The signalfd is created when the first signal handle is started. */
+  if (s->fds[0] == -1) {
+    if (faio__signals_open(s))
+      return -1;
+
+    if (faio_add(loop,
+                 &loop->signal_handle,
+                 faio__signal_io,
+                 s->fds[0],
+                 FAIO_POLLIN))
+    {
+      faio__signals_fini(s);
+      return -1;
+    }
+  }
+
+  faio_signal_stop(loop, sig);
+
+  if (faio__signals_watch(s, signum))
+    return -1;
+
+  sig->cb = cb;
+  sig->signum = signum;
+  faio__queue_append(&s->queue, &sig->queue);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_batch_size(struct faio_loop *loop, unsigned int size)
+{
+  return faio__batch_set(&loop->batch, size);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_set_budget(struct faio_loop *loop,
+                            unsigned int events,
+                            uint64_t ns)
+{
+  loop->budget.events = events;
+  loop->budget.ns = ns;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_priority(struct faio_loop *loop,
+                             struct faio_handle *handle,
+                             unsigned int priority)
+{
+  (void) loop;
+
+  if (priority >= FAIO__PRIORITIES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  handle->priority = priority;
+
+  return 0;
+}
+
+#if !defined(FAIO__SHARED)
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_shared(struct faio_loop *loop)
+{
+  (void) loop;
+  errno = ENOTSUP;
+  return -1;
+}
+#endif
+
+FAIO_ATTRIBUTE_UNUSED
+static uint64_t faio_full_batches(const struct faio_loop *loop)
+{
+  return loop->batch.full_batches;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_busy_poll_stats(const struct faio_loop *loop,
+                                 uint64_t *spin_wakeups,
+                                 uint64_t *block_wakeups)
+{
+  *spin_wakeups = loop->busy.spin_wakeups;
+  *block_wakeups = loop->busy.block_wakeups;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_set_watchdog(struct faio_loop *loop,
+                              void (*hook)(struct faio_loop *loop,
+                                           const struct faio_slow_callback *),
+                              uint64_t threshold_ns,
+                              unsigned int sample)
+{
+  struct faio__watchdog *w;
+
+  w = &loop->watchdog;
+  w->hook = hook;
+  w->threshold = threshold_ns;
+  w->sample = sample == 0 ? 1 : sample;
+  w->countdown = 1;
+  w->start = 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_slab_init(struct faio_loop *loop,
+                          struct faio_slab *slab,
+                          size_t size,
+                          unsigned int prewarm)
+{
+  if (faio__slab_init(slab, size, prewarm))
+    return -1;
+
+  faio__queue_append(&loop->slabs, &slab->queue);
+
+  return 0;
+}
+
+static int faio__writeq_flush(struct faio_loop *loop,
+                              struct faio_writeq *wq,
+                              int more)
+{
+  struct faio_handle *handle;
+  struct faio__queue done;
+  int saved_errno;
+  int r;
+
+  if (wq->corked)
+    return 0;
+
+  handle = wq->handle;
+  faio__queue_init(&done);
+  r = faio__writeq_write(wq, handle->fd, more, &done);
+  saved_errno = errno;
+
+  if (r == -1)
+    faio__writeq_fail(wq, &done, -saved_errno);
+
+  /* Wait for writability only while there's something left to write, and
+   * leave FAIO_POLLOUT alone if the caller asked for it.
+   */
+  if (r == 1 && wq->polling == 0 && 0 == (handle->events & FAIO_POLLOUT)) {
+    if (faio_mod(loop, handle, handle->events | FAIO_POLLOUT)) {
+      saved_errno = errno;
+      faio__writeq_fail(wq, &done, -saved_errno);
+      r = -1;
+    }
+    else
+      wq->polling = 1;
+  }
+
+  if (r != 1 && wq->polling) {
+    wq->polling = 0;
+    faio_mod(loop, handle, handle->events & ~FAIO_POLLOUT);
+  }
+
+  faio__writeq_complete(loop, &done);
+
+  if (r == -1) {
+    errno = saved_errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_flush(struct faio_loop *loop, struct faio_writeq *wq)
+{
+  return faio__writeq_flush(loop, wq, 0);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_flush_more(struct faio_loop *loop,
+                                  struct faio_writeq *wq)
+{
+  return faio__writeq_flush(loop, wq, 1);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_uncork(struct faio_loop *loop, struct faio_writeq *wq)
+{
+  wq->corked = 0;
+
+  return faio_writeq_flush(loop, wq);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_cancel(struct faio_loop *loop, struct faio_writeq *wq)
+{
+  struct faio__queue done;
+
+  faio__queue_init(&done);
+  faio__writeq_fail(wq, &done, -ECANCELED);
+
+  if (wq->polling) {
+    wq->polling = 0;
+    faio_mod(loop, wq->handle, wq->handle->events & ~FAIO_POLLOUT);
+  }
+
+  faio__writeq_complete(loop, &done);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_zerocopy(struct faio_writeq *wq, size_t threshold)
+{
+#if defined(FAIO__WRITEQ_ZEROCOPY)
+  int on;
+
+  on = 1;
+
+  if (setsockopt(wq->handle->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
+    return -1;
+
+  wq->zc_threshold = threshold > 0 ? threshold : 1;
+  wq->zerocopy = 1;
+
+  return 0;
+#else
+  (void) wq;
+  (void) threshold;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_reap(struct faio_loop *loop, struct faio_writeq *wq)
+{
+  struct faio__queue done;
+  socklen_t len;
+  int found;
+  int err;
+
+  faio__queue_init(&done);
+  found = 0;
+
+#if defined(FAIO__WRITEQ_ZEROCOPY)
+  found = faio__writeq_notifications(wq, wq->handle->fd, &done);
+#endif
+
+  if (found) {
+    faio__writeq_complete(loop, &done);
+    return 0;
+  }
+
+  /* Not a notification, see if it's a real error. */
+  err = 0;
+  len = sizeof(err);
+
+  if (getsockopt(wq->handle->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    return -1;
+
+  if (err == 0)
+    return 0;
+
+  errno = err;
+  return -1;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_stats_snapshot(const struct faio_loop *loop,
+                               struct faio_stats *stats)
+{
+#if defined(FAIO_STATS)
+  *stats = loop->stats.counters;
+  return 0;
+#else
+  (void) loop;
+  memset(stats, 0, sizeof(*stats));
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+#endif /* FAIO_COMMON_H_ */
@@ -18,14 +18,30 @@
 #define FAIO_EPOLL_H_
 
 #include "faio-util.h"
+#include "faio-timer.h"
+#include "faio-async.h"
+#include "faio-signal.h"
+#include "faio-batch.h"
+#include "faio-busy.h"
+#include "faio-budget.h"
+#include "faio-priority.h"
+#include "faio-stats.h"
+#include "faio-probes.h"
+#include "faio-watchdog.h"
+#include "faio-slab.h"
+#include "faio-writeq.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,21 +50,589 @@
 #define FAIO_POLLERR  EPOLLERR
 #define FAIO_POLLHUP  EPOLLHUP
 
-struct faio_loop
+/* Linux 6.9 added per-epoll-instance busy polling of the NAPI contexts of
+ * the sockets in the set. Not in older headers.
+ */
+struct faio__epoll_params
 {
-  struct faio__queue pending_queue;
-  int epoll_fd;
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t pad;
+};
+
+#define FAIO__EPIOCSPARAMS _IOW(0x8A, 0x01, struct faio__epoll_params)
+
+/* Linux 4.5 can wake up just one of the epoll instances that wait on a
+ * shared file descriptor, see faio_listener_start(). Not in older headers.
+ */
+#if !defined(EPOLLEXCLUSIVE)
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define FAIO__EXCLUSIVE 1
+
+/* Shared mode, see faio_set_shared(). Handles are registered with
+ * EPOLLONESHOT and level-triggered: the kernel disables a handle when it
+ * reports it to one of the threads, and that thread arms it again when
+ * the callback returns. From the moment a thread takes the event until
+ * then, the handle is claimed. Events for claimed handles are dropped;
+ * other threads can still get one when faio_mod() arms the handle before
+ * the claim is recorded.
+ *
+ * Every thread that polls the loop gets a worker with its own batch,
+ * budget and pending queues. |lock| protects the slots, the claims and
+ * the pending queues of all workers, and is never held across callbacks.
+ * |timers_lock| serializes the timers and async handles. It's recursive
+ * because their callbacks start and stop timers.
+ */
+#define FAIO__SHARED 1
+
+struct faio__epoll_worker
+{
+  struct faio__queue queue; /* In the loop's list of workers. */
+  struct faio__queue pending_queue[FAIO__PRIORITIES];
+  struct faio__budget budget;
+  struct epoll_event *events;
+  unsigned int size;
+  pthread_t thread;
 };
 
 struct faio_handle
 {
-  struct faio__queue pending_queue;
+  struct faio__queue pending_queue; /* Also links the sorted batch. */
+  struct faio__queue change_queue;  /* Waiting for EPOLL_CTL_ADD. */
   void (*cb)(struct faio_loop *, struct faio_handle *, unsigned int);
-  unsigned int events;  /* What the user wants to get notified about. */
-  unsigned int revents; /* What is actually active. */
+  unsigned int events;   /* What the user wants to get notified about. */
+  unsigned int revents;  /* What is actually active. */
+  unsigned int flags;    /* Extra flags for EPOLL_CTL_ADD. */
+  unsigned int priority; /* FAIO_PRIORITY_HIGH, _NORMAL or _LOW. */
+  unsigned int claimed;  /* Shared mode, being dispatched by a thread. */
   int fd;
+  uint64_t id;          /* What the kernel hands back, see faio-slab.h. */
+};
+
+struct faio_loop
+{
+  struct faio__queue pending_queue[FAIO__PRIORITIES];
+  struct faio__queue change_queue;
+  struct faio__timers timers;
+  struct faio__asyncs asyncs;
+  struct faio_handle async_handle;
+  struct faio__signals signals;
+  struct faio_handle signal_handle;
+  struct faio__batch batch;
+  struct faio__busy busy;
+  struct faio__budget budget;
+  struct faio__watchdog watchdog;
+  struct faio__queue slabs;
+  struct faio__slots slots;
+#if defined(FAIO_STATS)
+  struct faio__stats stats;
+#endif
+  struct faio__queue workers; /* Shared mode only, like the locks. */
+  pthread_mutex_t lock;
+  pthread_mutex_t timers_lock;
+  int shared;
+  int have_pwait2;
+  int timer_fd; /* For sub-millisecond timeouts without epoll_pwait2(). */
+  int epoll_fd;
 };
 
+static void faio__epoll_lock(struct faio_loop *loop)
+{
+  if (loop->shared)
+    pthread_mutex_lock(&loop->lock);
+}
+
+static void faio__epoll_unlock(struct faio_loop *loop)
+{
+  if (loop->shared)
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/* For faio_timer_start() and faio_timer_stop(). */
+static void faio__shared_timers_lock(struct faio_loop *loop)
+{
+  if (loop->shared)
+    pthread_mutex_lock(&loop->timers_lock);
+}
+
+static void faio__shared_timers_unlock(struct faio_loop *loop)
+{
+  if (loop->shared)
+    pthread_mutex_unlock(&loop->timers_lock);
+}
+
+static void faio__update_time(struct faio_loop *loop)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  faio__timers_update(&loop->timers, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Creates the timerfd on first use. Its events carry an invalid handle
+ * ID, the dispatch loop skips them. Returns -1 if it can't be created.
+ */
+static int faio__epoll_timer_fd(struct faio_loop *loop)
+{
+  struct epoll_event evt;
+  int fd;
+
+  if (loop->timer_fd != -1)
+    return loop->timer_fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+  if (fd == -1)
+    return -1;
+
+  /* Edge-triggered, every expiration is a new edge. That way we never
+   * have to read from it.
+   */
+  evt.events = EPOLLIN | EPOLLET;
+  evt.data.u64 = (uint64_t) -1;
+
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &evt)) {
+    close(fd);
+    return -1;
+  }
+
+  loop->timer_fd = fd;
+
+  return fd;
+}
+
+/* Like epoll_wait() but with a timeout in nanoseconds, -1 is infinite.
+ * Uses epoll_pwait2() when the kernel has it (Linux 5.11) and arms a
+ * timerfd otherwise, unless the timeout is in whole milliseconds anyway.
+ */
+static int faio__epoll_wait(struct faio_loop *loop,
+                            struct epoll_event *events,
+                            int maxevents,
+                            int64_t ns)
+{
+  struct itimerspec its;
+  struct timespec ts;
+  int64_t ms;
+  int n;
+
+  if (ns <= 0)
+    return epoll_wait(loop->epoll_fd, events, maxevents, ns < 0 ? -1 : 0);
+
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+
+#if defined(SYS_epoll_pwait2)
+  if (loop->have_pwait2) {
+    n = syscall(SYS_epoll_pwait2,
+                loop->epoll_fd,
+                events,
+                maxevents,
+                &ts,
+                NULL,
+                0);
+
+    if (n != -1 || errno != ENOSYS)
+      return n;
+
+    loop->have_pwait2 = 0;
+  }
+#endif /* defined(SYS_epoll_pwait2) */
+
+  ms = (ns + 999999) / 1000000;
+
+  if (ms > INT_MAX)
+    ms = INT_MAX;
+
+  /* The timerfd can only be armed for one thread at a time. */
+  if (ns % 1000000 == 0 || loop->shared || faio__epoll_timer_fd(loop) == -1)
+    return epoll_wait(loop->epoll_fd, events, maxevents, ms);
+
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 0;
+  its.it_value = ts;
+
+  if (timerfd_settime(loop->timer_fd, 0, &its, NULL))
+    return epoll_wait(loop->epoll_fd, events, maxevents, ms);
+
+  /* The timerfd wakes us up. A stale expiration from a previous call can
+   * only make us return early, and the caller polls again in that case.
+   */
+  return epoll_wait(loop->epoll_fd, events, maxevents, -1);
+}
+
+/* Register the handles that were added since the last call. Handles that
+ * the kernel rejects get a FAIO_POLLERR event through the pending queue.
+ */
+static void faio__epoll_apply_changes(struct faio_loop *loop)
+{
+  struct faio_handle *handle;
+  struct faio__queue *queue;
+  struct epoll_event evt;
+
+  while (!faio__queue_empty(&loop->change_queue)) {
+    queue = faio__queue_head(&loop->change_queue);
+    handle = faio__queue_data(queue, struct faio_handle, change_queue);
+    faio__queue_remove(queue);
+
+    evt.events = EPOLLIN | EPOLLOUT | EPOLLET | handle->flags;
+    evt.data.u64 = handle->id;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handle->fd, &evt) == 0)
+      continue;
+
+    handle->revents = EPOLLERR;
+
+    if (faio__queue_empty(&handle->pending_queue))
+      faio__queue_append(&loop->pending_queue[handle->priority],
+                         &handle->pending_queue);
+  }
+}
+
+/* Dispatch the handles in |ready|, highest priority first, until the
+ * budget runs out. What's left goes back on the pending queues: in front
+ * of what is there for handles that were already pending when the call
+ * started (|replay| is set), behind it for new events. Returns 1 if any
+ * callbacks ran.
+ */
+static int faio__epoll_dispatch(struct faio_loop *loop,
+                                struct faio__queue *ready,
+                                int replay)
+{
+  struct faio_handle *handle;
+  struct faio__queue *queue;
+  unsigned int revents;
+  unsigned int prio;
+  int dispatched;
+
+  dispatched = 0;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++) {
+    while (!faio__queue_empty(&ready[prio])) {
+      if (faio__budget_spent(&loop->budget))
+        break;
+
+      queue = faio__queue_head(&ready[prio]);
+      handle = faio__queue_data(queue, struct faio_handle, pending_queue);
+      faio__queue_remove(queue);
+
+      if (replay)
+        FAIO__STATS(loop->stats.counters.pending_replays++);
+
+      revents = handle->revents & handle->events;
+      if (revents == 0)
+        continue;
+
+      FAIO__STATS(loop->stats.counters.callbacks++);
+
+      if (replay) {
+        FAIO__PROBE3(replay, handle->fd, revents, handle);
+      } else {
+        FAIO__PROBE3(dispatch, handle->fd, revents, handle);
+      }
+
+      faio__watchdog_begin(&loop->watchdog, handle->fd, handle->cb);
+      handle->cb(loop, handle, revents);
+      FAIO__PROBE(dispatch__done);
+      faio__watchdog_end(loop, &loop->watchdog);
+      faio__budget_charge(&loop->budget);
+      dispatched = 1;
+    }
+  }
+
+  if (replay) {
+    faio__priority_prepend(ready, loop->pending_queue);
+    return dispatched;
+  }
+
+#if defined(FAIO_STATS)
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    for (queue = faio__queue_head(&ready[prio]);
+         queue != &ready[prio];
+         queue = queue->next)
+    {
+      loop->stats.counters.budget_carryovers++;
+    }
+#endif
+
+  faio__priority_concat(ready, loop->pending_queue);
+
+  return dispatched;
+}
+
+/* Make sure that events for |handle| that are still waiting to be
+ * dispatched in the current batch don't get dispatched; the caller is
+ * about to free it. Releasing the slot bumps its generation and the
+ * events still carry the old one.
+ */
+static void faio__epoll_forget(struct faio_loop *loop,
+                               struct faio_handle *handle)
+{
+  if (faio__slots_get(&loop->slots, handle->id) == handle)
+    faio__slots_free(&loop->slots, handle->id);
+}
+
+/* Poll without blocking until there are events or the busy poll budget
+ * runs out. Returns the number of events.
+ */
+static int faio__epoll_spin(struct faio_loop *loop,
+                            struct epoll_event *events,
+                            int maxevents,
+                            int64_t ns)
+{
+  uint64_t stop;
+  int n;
+
+  stop = faio__busy_deadline(&loop->busy, ns);
+
+  if (stop == 0)
+    return 0;
+
+  do {
+    n = epoll_wait(loop->epoll_fd, events, maxevents, 0);
+    FAIO__STATS(faio__stats_poll(&loop->stats, n, maxevents));
+
+    if (n == -1 && errno != EINTR)
+      abort();
+
+    if (n > 0 || faio__asyncs_pending(&loop->asyncs)) {
+      FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
+      loop->busy.spin_wakeups++;
+      return n > 0 ? n : 0;
+    }
+  }
+  while (faio__busy_hrtime() < stop);
+
+  return 0;
+}
+
+/* Returns the calling thread's worker, creating it on first use. Called
+ * with |loop->lock| held.
+ */
+static struct faio__epoll_worker *faio__epoll_worker(struct faio_loop *loop)
+{
+  struct faio__epoll_worker *w;
+  struct faio__queue *queue;
+  pthread_t self;
+
+  self = pthread_self();
+
+  for (queue = faio__queue_head(&loop->workers);
+       queue != &loop->workers;
+       queue = queue->next)
+  {
+    w = faio__queue_data(queue, struct faio__epoll_worker, queue);
+
+    if (pthread_equal(w->thread, self))
+      return w;
+  }
+
+  /* The batch size is fixed from here on. */
+  w = malloc(sizeof(*w) + loop->batch.size * sizeof(struct epoll_event));
+
+  if (w == NULL)
+    abort();
+
+  w->events = (struct epoll_event *) (w + 1);
+  w->size = loop->batch.size;
+  w->thread = self;
+  faio__priority_init(w->pending_queue);
+  faio__budget_init(&w->budget);
+  faio__queue_append(&loop->workers, &w->queue);
+
+  return w;
+}
+
+/* Called with |loop->lock| held when a claimed handle is done. It's
+ * level-triggered, the kernel reports it again right away if it's still
+ * ready.
+ */
+static void faio__epoll_rearm(struct faio_loop *loop,
+                              struct faio_handle *handle)
+{
+  struct epoll_event evt;
+
+  evt.events = handle->events | EPOLLONESHOT;
+  evt.data.u64 = handle->id;
+  handle->claimed = 0;
+
+  /* Only fails when the fd was closed without faio_del() first. */
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handle->fd, &evt);
+}
+
+/* Shared mode counterpart of faio__epoll_dispatch(). Handles that another
+ * thread deletes while they wait in |ready| are taken off it, and the
+ * ones that are deleted while their callback runs are not armed again.
+ */
+static int faio__epoll_dispatch_shared(struct faio_loop *loop,
+                                       struct faio__epoll_worker *w,
+                                       struct faio__queue *ready,
+                                       int replay)
+{
+  struct faio_handle *handle;
+  struct faio__queue *queue;
+  unsigned int revents;
+  unsigned int prio;
+  uint64_t id;
+  int dispatched;
+
+  dispatched = 0;
+  pthread_mutex_lock(&loop->lock);
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++) {
+    while (!faio__queue_empty(&ready[prio])) {
+      if (faio__budget_spent(&w->budget))
+        break;
+
+      queue = faio__queue_head(&ready[prio]);
+      handle = faio__queue_data(queue, struct faio_handle, pending_queue);
+      faio__queue_remove(queue);
+      revents = handle->revents & handle->events;
+      id = handle->id;
+
+      if (revents != 0) {
+        pthread_mutex_unlock(&loop->lock);
+
+        if (replay) {
+          FAIO__PROBE3(replay, handle->fd, revents, handle);
+        } else {
+          FAIO__PROBE3(dispatch, handle->fd, revents, handle);
+        }
+
+        handle->cb(loop, handle, revents);
+        FAIO__PROBE(dispatch__done);
+        faio__budget_charge(&w->budget);
+        dispatched = 1;
+        pthread_mutex_lock(&loop->lock);
+      }
+
+      if (faio__slots_get(&loop->slots, id) == handle)
+        faio__epoll_rearm(loop, handle);
+    }
+  }
+
+  if (replay)
+    faio__priority_prepend(ready, w->pending_queue);
+  else
+    faio__priority_concat(ready, w->pending_queue);
+
+  pthread_mutex_unlock(&loop->lock);
+
+  return dispatched;
+}
+
+/* faio_poll_ns() in shared mode. Whichever thread takes |timers_lock|
+ * first runs the timers and async handles and blocks until the next timer
+ * expires; the others block until their deadline. faio_set_shared() makes
+ * faio_async_send() write to the wakeup fd even when nobody is blocked,
+ * more than one thread can be, so only a pending flag is checked here.
+ */
+static void faio__epoll_poll_shared(struct faio_loop *loop, int64_t timeout)
+{
+  struct faio__queue ready[FAIO__PRIORITIES];
+  struct faio__epoll_worker *w;
+  struct faio_handle *handle;
+  uint64_t deadline;
+  uint64_t now;
+  int dispatched;
+  int64_t ns;
+  int i;
+  int n;
+
+  pthread_mutex_lock(&loop->lock);
+  w = faio__epoll_worker(loop);
+  faio__priority_move(w->pending_queue, ready);
+  pthread_mutex_unlock(&loop->lock);
+
+  w->budget.events = loop->budget.events;
+  w->budget.ns = loop->budget.ns;
+  faio__budget_begin(&w->budget);
+  dispatched = faio__epoll_dispatch_shared(loop, w, ready, 1);
+
+  if (dispatched)
+    timeout = 0;
+
+  now = faio__busy_hrtime();
+
+  if (timeout < 0)
+    deadline = UINT64_MAX;
+  else
+    deadline = now + timeout;
+
+  for (;;) {
+    if (deadline == UINT64_MAX)
+      ns = -1;
+    else if (deadline > now)
+      ns = deadline - now;
+    else
+      ns = 0;
+
+    if (pthread_mutex_trylock(&loop->timers_lock) == 0) {
+      faio__update_time(loop);
+
+      if (faio__asyncs_run(loop, &loop->asyncs))
+        dispatched = 1;
+
+      if (faio__timers_run(loop, &loop->timers))
+        dispatched = 1;
+
+      ns = faio__timers_timeout(&loop->timers, deadline);
+      pthread_mutex_unlock(&loop->timers_lock);
+    }
+
+    if (dispatched || faio__asyncs_pending(&loop->asyncs))
+      ns = 0;
+
+    FAIO__PROBE1(poll__begin, ns);
+    n = faio__epoll_wait(loop, w->events, w->size, ns);
+    FAIO__PROBE1(poll__end, n);
+
+    if (n == -1) {
+      if (errno != EINTR)
+        abort();
+
+      n = 0;
+    }
+
+    faio__priority_init(ready);
+    pthread_mutex_lock(&loop->lock);
+
+    for (i = 0; i < n; i++) {
+      handle = faio__slots_get(&loop->slots, w->events[i].data.u64);
+
+      if (handle == NULL || handle->claimed)
+        continue;
+
+      handle->claimed = 1;
+      handle->revents = w->events[i].events;
+      faio__queue_append(&ready[handle->priority], &handle->pending_queue);
+    }
+
+    pthread_mutex_unlock(&loop->lock);
+
+    if (faio__epoll_dispatch_shared(loop, w, ready, 0))
+      dispatched = 1;
+
+    now = faio__busy_hrtime();
+
+    /* Same as in faio_poll_ns(), there might be more. */
+    if (w->size == (unsigned int) n && !faio__budget_spent(&w->budget)) {
+      deadline = now;
+      continue;
+    }
+
+    /* Handles are only left on the pending queue when the budget ran
+     * out, and then something was dispatched.
+     */
+    if (dispatched || now >= deadline)
+      return;
+  }
+}
+
 FAIO_ATTRIBUTE_UNUSED
 static int faio_init(struct faio_loop *loop)
 {
@@ -77,8 +661,28 @@ static int faio_init(struct faio_loop *loop)
   if (epoll_fd == -1)
     return -1;
 
+  if (faio__batch_init(&loop->batch, sizeof(struct epoll_event))) {
+    close(epoll_fd);
+    return -1;
+  }
+
   loop->epoll_fd = epoll_fd;
-  faio__queue_init(&loop->pending_queue);
+  loop->shared = 0;
+  loop->have_pwait2 = 1;
+  loop->timer_fd = -1;
+  faio__priority_init(loop->pending_queue);
+  faio__queue_init(&loop->change_queue);
+  faio__queue_init(&loop->workers);
+  faio__update_time(loop);
+  faio__timers_init(&loop->timers, loop->timers.now);
+  faio__asyncs_init(&loop->asyncs);
+  faio__signals_init(&loop->signals);
+  faio__busy_init(&loop->busy);
+  faio__budget_init(&loop->budget);
+  faio__watchdog_init(&loop->watchdog);
+  faio__queue_init(&loop->slabs);
+  faio__slots_init(&loop->slots);
+  FAIO__STATS(faio__stats_init(&loop->stats));
 
   return 0;
 }
@@ -86,126 +690,170 @@ static int faio_init(struct faio_loop *loop)
 FAIO_ATTRIBUTE_UNUSED
 static void faio_fini(struct faio_loop *loop)
 {
+  struct faio__queue *queue;
+
+  while (!faio__queue_empty(&loop->workers)) {
+    queue = faio__queue_head(&loop->workers);
+    faio__queue_remove(queue);
+    free(faio__queue_data(queue, struct faio__epoll_worker, queue));
+  }
+
+  if (loop->shared) {
+    pthread_mutex_destroy(&loop->lock);
+    pthread_mutex_destroy(&loop->timers_lock);
+  }
+
+  loop->shared = 0;
+  faio__asyncs_fini(&loop->asyncs);
+  faio__signals_fini(&loop->signals);
+  faio__batch_fini(&loop->batch);
+  faio__slabs_fini(&loop->slabs);
+  faio__slots_fini(&loop->slots);
+
+  if (loop->timer_fd != -1)
+    close(loop->timer_fd);
+
+  loop->timer_fd = -1;
   close(loop->epoll_fd);
   loop->epoll_fd = -1;
 }
 
 FAIO_ATTRIBUTE_UNUSED
-static void faio_poll(struct faio_loop *loop, double timeout)
+static void faio_poll_ns(struct faio_loop *loop, int64_t timeout)
 {
-  struct epoll_event events[256]; /* 3 kB */
+  struct faio__queue ready[FAIO__PRIORITIES];
+  struct epoll_event *events;
   struct faio_handle *handle;
-  struct faio__queue *queue;
-  struct timespec before;
-  struct timespec after;
-  unsigned long elapsed;
+  uint64_t deadline;
   unsigned int dispatched;
   unsigned int maxevents;
-  unsigned int revents;
-  int ms;
+  int64_t ns;
   int i;
   int n;
 
-  dispatched = 0;
-  maxevents = sizeof(events) / sizeof(events[0]);
+  if (loop->shared) {
+    faio__epoll_poll_shared(loop, timeout);
+    return;
+  }
 
-  while (!faio__queue_empty(&loop->pending_queue)) {
-    queue = faio__queue_head(&loop->pending_queue);
-    handle = faio__queue_data(queue, struct faio_handle, pending_queue);
-    faio__queue_remove(queue);
+  faio__budget_begin(&loop->budget);
+  FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
 
-    revents = handle->revents & handle->events;
-    if (revents == 0)
-      continue;
+  /* Handles that callbacks put back on the pending queue are replayed in
+   * the next call, not this one. A handle that keeps doing that would
+   * otherwise never let go of the loop.
+   */
+  faio__priority_move(loop->pending_queue, ready);
+  dispatched = faio__epoll_dispatch(loop, ready, 1);
+
+  faio__update_time(loop);
+  FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
 
-    handle->cb(loop, handle, revents);
+  if (faio__timers_run(loop, &loop->timers))
     dispatched = 1;
+
+  if (dispatched)
     timeout = 0;
-  }
 
   if (timeout < 0)
-    ms = -1;
+    deadline = UINT64_MAX;
   else
-    ms = timeout * 1000;
-
-  if (ms > 0)
-    if (clock_gettime(CLOCK_MONOTONIC, &before))
-      abort();
+    deadline = loop->timers.hrnow + timeout;
 
   for (;;) {
-    n = epoll_wait(loop->epoll_fd, events, maxevents, ms);
+    faio__epoll_apply_changes(loop);
+    ns = faio__timers_timeout(&loop->timers, deadline);
+
+    if (!faio__priority_empty(loop->pending_queue))
+      ns = 0;
+
+    events = loop->batch.events;
+    maxevents = loop->batch.size;
+    n = faio__epoll_spin(loop, events, maxevents, ns);
 
     if (n == 0) {
-      /* A -1 timeout means "wait indefinitely" and modern kernels do
-       * but old (ancient) kernels wait for LONG_MAX milliseconds.
-       */
-      if (ms == -1)
-        continue;
-      else
-        return;
-    }
+      if (faio__asyncs_before_wait(&loop->asyncs))
+        ns = 0;
 
-    if (n == -1) {
-      if (errno == EINTR)
-        goto update_timeout;
-      else
-        abort();
+      FAIO__STATS(faio__stats_wait_begin(&loop->stats));
+      FAIO__PROBE1(poll__begin, ns);
+      n = faio__epoll_wait(loop, events, maxevents, ns);
+      FAIO__PROBE1(poll__end, n);
+      FAIO__STATS(faio__stats_wait_end(&loop->stats, n, maxevents));
+      faio__asyncs_after_wait(&loop->asyncs);
+
+      if (n == -1) {
+        if (errno != EINTR)
+          abort();
+
+        n = 0;
+      }
+
+      if (n > 0 && ns != 0)
+        loop->busy.block_wakeups++;
     }
 
+    FAIO__STATS(loop->stats.counters.events += n);
+
+    /* Sort the batch by priority before running any callbacks. A callback
+     * that deletes a handle takes it off its list.
+     */
+    faio__priority_init(ready);
+
     for (i = 0; i < n; i++) {
-      handle = (struct faio_handle *) events[i].data.ptr;
-      revents = events[i].events;
-      handle->revents = revents;
+      handle = faio__slots_get(&loop->slots, events[i].data.u64);
 
-      revents &= handle->events;
-      if (revents == 0)
+      /* The timerfd. */
+      if (handle == NULL)
         continue;
 
-      handle->cb(loop, handle, revents);
-      dispatched = 1;
-    }
+      handle->revents = events[i].events;
 
-    /* We read as many events as we could but there might still be more.
-     * Poll again but don't block this time.
-     */
-    if (maxevents == (unsigned int) n) {
-      ms = 0;
-      continue;
-    }
+      if ((handle->revents & handle->events) == 0)
+        continue;
 
-    if (dispatched)
-      return;
+      /* Still pending from an earlier call. */
+      if (!faio__queue_empty(&handle->pending_queue))
+        continue;
 
-    /* We didn't invoke any callbacks, just updated some watchers.
-     * From the perspective of the caller nothing happened so update
-     * the timeout and poll again.
-     */
+      faio__queue_append(&ready[handle->priority], &handle->pending_queue);
+    }
 
-update_timeout:
-    if (ms == 0)
-      return;
+    if (faio__epoll_dispatch(loop, ready, 0))
+      dispatched = 1;
 
-    if (ms == -1)
-      continue;
+    faio__batch_update(&loop->batch, n);
 
-    if (clock_gettime(CLOCK_MONOTONIC, &after))
-      abort();
+    if (faio__asyncs_run(loop, &loop->asyncs))
+      dispatched = 1;
 
-    /* Guard against an unlikely overflow in calculating the elapsed time. */
-    if ((after.tv_sec - before.tv_sec) > (ms / 1000))
-      return;
+    faio__update_time(loop);
+    FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
 
-    elapsed  = 1000UL;
-    elapsed -= before.tv_nsec / 1000000UL;
-    elapsed += after.tv_nsec / 1000000UL;
-    elapsed %= 1000UL;
-    elapsed += 1000UL * (after.tv_sec - before.tv_sec);
+    if (faio__timers_run(loop, &loop->timers))
+      dispatched = 1;
 
-    if (elapsed >= (unsigned long) ms)
+    /* We read as many events as we could but there might still be more.
+     * Poll again but don't block this time, budget permitting.
+     */
+    if (maxevents == (unsigned int) n &&
+        !faio__budget_spent(&loop->budget))
+    {
+      deadline = loop->timers.hrnow;
+      continue;
+    }
+
+    if (dispatched || !faio__priority_empty(loop->pending_queue))
       return;
 
-    ms -= elapsed;
-    before = after;
+    /* We didn't invoke any callbacks, just updated some watchers or woke
+     * up early. From the perspective of the caller nothing happened so
+     * poll again, unless the timeout expired. A -1 timeout means "wait
+     * indefinitely" and modern kernels do but old (ancient) kernels wait
+     * for LONG_MAX milliseconds.
+     */
+    if (loop->timers.hrnow >= deadline)
+      return;
   }
 }
 
@@ -219,20 +867,67 @@ static int faio_add(struct faio_loop *loop,
                     unsigned int events)
 {
   struct epoll_event evt;
+  int r;
 
   events &= EPOLLIN | EPOLLOUT;
   events |= EPOLLERR | EPOLLHUP;
 
   faio__queue_init(&handle->pending_queue);
+  faio__queue_init(&handle->change_queue);
   handle->cb = cb;
   handle->fd = fd;
   handle->events = events;
   handle->revents = 0;
+  handle->flags = 0;
+  handle->priority = FAIO_PRIORITY_NORMAL;
+  handle->claimed = 0;
+
+  faio__epoll_lock(loop);
+  r = faio__slots_alloc(&loop->slots, handle, &handle->id);
+  faio__epoll_unlock(loop);
+
+  if (r)
+    return -1;
 
-  evt.events = EPOLLIN | EPOLLOUT | EPOLLET;
-  evt.data.ptr = handle;
+  FAIO__PROBE3(add, fd, events, handle);
 
-  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &evt);
+  /* Other threads may be blocked in the kernel already, there is no
+   * "right before the loop blocks" to defer it to. The handle can be
+   * dispatched before this function returns.
+   */
+  if (loop->shared) {
+    evt.events = events | EPOLLONESHOT;
+    evt.data.u64 = handle->id;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &evt) == 0)
+      return 0;
+
+    r = errno;
+    faio__epoll_lock(loop);
+    faio__slots_free(&loop->slots, handle->id);
+    faio__epoll_unlock(loop);
+    errno = r;
+
+    return -1;
+  }
+
+  /* Registered right before the loop blocks. Errors like EBADF are
+   * reported as FAIO_POLLERR events.
+   */
+  faio__queue_append(&loop->change_queue, &handle->change_queue);
+
+  return 0;
+}
+
+/* Must be called before the loop registers |handle|, i.e. right after
+ * faio_add(). The kernel doesn't allow changing it afterwards. Has no
+ * effect in shared mode, where faio_add() registers handles right away
+ * and there's only one epoll instance anyway.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__exclusive(struct faio_handle *handle)
+{
+  handle->flags |= EPOLLEXCLUSIVE;
 }
 
 FAIO_ATTRIBUTE_UNUSED
@@ -240,15 +935,37 @@ static int faio_mod(struct faio_loop *loop,
                     struct faio_handle *handle,
                     unsigned int events)
 {
+  struct epoll_event evt;
+  int r;
+
   events &= EPOLLIN | EPOLLOUT;
   events |= EPOLLERR | EPOLLHUP;
+  FAIO__PROBE3(mod, handle->fd, events, handle);
+
+  /* The thread that claimed the handle arms it again when it's done. */
+  if (loop->shared) {
+    r = 0;
+    evt.events = events | EPOLLONESHOT;
+    evt.data.u64 = handle->id;
+    pthread_mutex_lock(&loop->lock);
+    handle->events = events;
+
+    if (!handle->claimed)
+      r = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handle->fd, &evt);
+
+    pthread_mutex_unlock(&loop->lock);
+
+    return r;
+  }
+
   handle->events = events;
 
   if (0 == (events & handle->revents))
     return 0;
 
   if (faio__queue_empty(&handle->pending_queue))
-    faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+    faio__queue_append(&loop->pending_queue[handle->priority],
+                       &handle->pending_queue);
 
   return 0;
 }
@@ -256,15 +973,117 @@ static int faio_mod(struct faio_loop *loop,
 FAIO_ATTRIBUTE_UNUSED
 static int faio_del(struct faio_loop *loop, struct faio_handle *handle)
 {
+  FAIO__PROBE2(del, handle->fd, handle);
+  faio__epoll_lock(loop);
   handle->events = 0;
 
+  /* In shared mode, possibly another thread's pending queue. */
   if (!faio__queue_empty(&handle->pending_queue))
     faio__queue_remove(&handle->pending_queue);
 
+  faio__epoll_forget(loop, handle);
+  faio__epoll_unlock(loop);
+
+  /* Never made it into the kernel, nothing to undo. */
+  if (!faio__queue_empty(&handle->change_queue)) {
+    faio__queue_remove(&handle->change_queue);
+    return 0;
+  }
+
   return epoll_ctl(loop->epoll_fd,
                    EPOLL_CTL_DEL,
                    handle->fd,
                    (struct epoll_event *) 1024); /* Work around kernel bug. */
 }
 
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_busy_poll(struct faio_loop *loop, unsigned int usecs)
+{
+  struct faio__epoll_params params;
+
+  if (usecs > INT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  loop->busy.usecs = usecs;
+
+  /* Best effort, fails with ENOTTY before Linux 6.9. */
+  memset(&params, 0, sizeof(params));
+  params.busy_poll_usecs = usecs;
+  params.busy_poll_budget = 8;
+  params.prefer_busy_poll = usecs != 0;
+  ioctl(loop->epoll_fd, FAIO__EPIOCSPARAMS, &params);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_shared(struct faio_loop *loop)
+{
+  pthread_mutexattr_t attr;
+
+  if (loop->shared)
+    return 0;
+
+  /* They have been or are about to be registered edge-triggered. */
+  if (loop->slots.used != 0) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  errno = pthread_mutexattr_init(&attr);
+
+  if (errno)
+    return -1;
+
+  errno = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+  if (errno == 0)
+    errno = pthread_mutex_init(&loop->timers_lock, &attr);
+
+  pthread_mutexattr_destroy(&attr);
+
+  if (errno)
+    return -1;
+
+  errno = pthread_mutex_init(&loop->lock, NULL);
+
+  if (errno) {
+    pthread_mutex_destroy(&loop->timers_lock);
+    return -1;
+  }
+
+  /* Tells faio_async_send() that the loop may be blocked, always, and
+   * to write the wakeup fd even if a wakeup is already outstanding.
+   */
+  loop->asyncs.polling = 1;
+  loop->asyncs.shared = 1;
+  loop->shared = 1;
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_close(struct faio_loop *loop, struct faio_handle *handle)
+{
+  FAIO__PROBE2(del, handle->fd, handle);
+  faio__epoll_lock(loop);
+  handle->events = 0;
+
+  if (!faio__queue_empty(&handle->pending_queue))
+    faio__queue_remove(&handle->pending_queue);
+
+  if (!faio__queue_empty(&handle->change_queue))
+    faio__queue_remove(&handle->change_queue);
+
+  faio__epoll_forget(loop, handle);
+  faio__epoll_unlock(loop);
+
+  /* Closing the last reference to the file removes it from the epoll set,
+   * no need for EPOLL_CTL_DEL.
+   */
+  return close(handle->fd);
+}
+
 #endif /* FAIO_EPOLL_H_ */
@@ -18,6 +18,18 @@
 #define FAIO_KQUEUE_H_
 
 #include "faio-util.h"
+#include "faio-timer.h"
+#include "faio-async.h"
+#include "faio-signal.h"
+#include "faio-batch.h"
+#include "faio-busy.h"
+#include "faio-budget.h"
+#include "faio-priority.h"
+#include "faio-stats.h"
+#include "faio-probes.h"
+#include "faio-watchdog.h"
+#include "faio-slab.h"
+#include "faio-writeq.h"
 
 #include <errno.h>
 #include <stdint.h>
@@ -38,21 +50,37 @@
 #define FAIO_POLLERR  POLLERR
 #define FAIO_POLLHUP  POLLHUP
 
-struct faio_loop
-{
-  struct faio__queue pending_queue;
-  int kq;
-};
-
 struct faio_handle
 {
   struct faio__queue pending_queue;
+  struct faio__queue batch_queue; /* Links the sorted batch. */
   void (*cb)(struct faio_loop *, struct faio_handle *, unsigned int);
   unsigned int revents;
   unsigned int events;
+  unsigned int batch_revents; /* Of all its kevents in the batch. */
+  unsigned int priority;
   int fd;
 };
 
+struct faio_loop
+{
+  struct faio__queue pending_queue;
+  struct faio__timers timers;
+  struct faio__asyncs asyncs;
+  struct faio_handle async_handle;
+  struct faio__signals signals;
+  struct faio_handle signal_handle;
+  struct faio__batch batch;
+  struct faio__busy busy;
+  struct faio__budget budget;
+  struct faio__watchdog watchdog;
+  struct faio__queue slabs;
+#if defined(FAIO_STATS)
+  struct faio__stats stats;
+#endif
+  int kq;
+};
+
 static int faio__gettime_monotonic(struct timespec *spec)
 {
 #if defined(__APPLE__)
@@ -68,6 +96,54 @@ static int faio__gettime_monotonic(struct timespec *spec)
 #endif
 }
 
+static void faio__update_time(struct faio_loop *loop)
+{
+  struct timespec ts;
+
+  if (faio__gettime_monotonic(&ts))
+    abort();
+
+  faio__timers_update(&loop->timers, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Poll without blocking until there are events or the busy poll budget
+ * runs out. Returns the number of events.
+ */
+static int faio__kqueue_spin(struct faio_loop *loop,
+                             struct kevent *events,
+                             int maxevents,
+                             int64_t ns)
+{
+  struct timespec ts;
+  uint64_t stop;
+  int n;
+
+  stop = faio__busy_deadline(&loop->busy, ns);
+
+  if (stop == 0)
+    return 0;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 0;
+
+  do {
+    n = kevent(loop->kq, NULL, 0, events, maxevents, &ts);
+    FAIO__STATS(faio__stats_poll(&loop->stats, n, maxevents));
+
+    if (n == -1 && errno != EINTR)
+      abort();
+
+    if (n > 0 || faio__asyncs_pending(&loop->asyncs)) {
+      FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
+      loop->busy.spin_wakeups++;
+      return n > 0 ? n : 0;
+    }
+  }
+  while (faio__busy_hrtime() < stop);
+
+  return 0;
+}
+
 FAIO_ATTRIBUTE_UNUSED
 static int faio_init(struct faio_loop *loop)
 {
@@ -78,7 +154,21 @@ static int faio_init(struct faio_loop *loop)
   if (kq == -1)
     return -1;
 
+  if (faio__batch_init(&loop->batch, sizeof(struct kevent))) {
+    close(kq);
+    return -1;
+  }
+
   faio__queue_init(&loop->pending_queue);
+  faio__update_time(loop);
+  faio__timers_init(&loop->timers, loop->timers.now);
+  faio__asyncs_init(&loop->asyncs);
+  faio__signals_init(&loop->signals);
+  faio__busy_init(&loop->busy);
+  faio__budget_init(&loop->budget);
+  faio__watchdog_init(&loop->watchdog);
+  faio__queue_init(&loop->slabs);
+  FAIO__STATS(faio__stats_init(&loop->stats));
   loop->kq = kq;
 
   return 0;
@@ -87,32 +177,37 @@ static int faio_init(struct faio_loop *loop)
 FAIO_ATTRIBUTE_UNUSED
 static void faio_fini(struct faio_loop *loop)
 {
+  faio__asyncs_fini(&loop->asyncs);
+  faio__signals_fini(&loop->signals);
+  faio__batch_fini(&loop->batch);
+  faio__slabs_fini(&loop->slabs);
   close(loop->kq);
   loop->kq = -1;
 }
 
 FAIO_ATTRIBUTE_UNUSED
-static void faio_poll(struct faio_loop *loop, double timeout)
+static void faio_poll_ns(struct faio_loop *loop, int64_t timeout)
 {
-  struct kevent events[256]; /* 8 kB */
+  struct faio__queue ready[FAIO__PRIORITIES];
+  struct kevent *events;
   struct faio_handle *handle;
   struct faio__queue *queue;
-  struct timespec before;
-  struct timespec after;
-  struct timespec diff;
   struct timespec *pts;
   struct timespec ts;
+  unsigned int dispatched;
   unsigned int maxevents;
   unsigned int revents;
+  unsigned int prio;
+  uint64_t deadline;
+  int64_t ns;
   int op;
   int i;
   int n;
 
-  /* Silence compiler warning. */
-  before.tv_nsec = 0;
-  before.tv_sec = 0;
-
-  maxevents = sizeof(events) / sizeof(events[0]);
+  dispatched = 0;
+  events = loop->batch.events;
+  maxevents = loop->batch.size;
+  faio__budget_begin(&loop->budget);
 
   n = 0;
 
@@ -153,36 +248,60 @@ static void faio_poll(struct faio_loop *loop, double timeout)
   if (n != 0)
     kevent(loop->kq, events, n, NULL, 0, NULL);
 
-  if (timeout < 0)
-    pts = NULL;
-  else if (timeout == 0) {
-    ts.tv_nsec = 0;
-    ts.tv_sec = 0;
-    pts = &ts;
-  }
-  else {
-    ts.tv_nsec = (unsigned long) (timeout * 1e9) % 1000000000UL;
-    ts.tv_sec = (unsigned long) timeout;
-    pts = &ts;
-  }
+  faio__update_time(loop);
 
-  if (pts != NULL)
-    if (faio__gettime_monotonic(&before))
-      abort();
+  if (faio__timers_run(loop, &loop->timers))
+    timeout = 0;
+
+  if (timeout < 0)
+    deadline = UINT64_MAX;
+  else
+    deadline = loop->timers.hrnow + timeout;
 
   for (;;) {
-    n = kevent(loop->kq, NULL, 0, events, maxevents, pts);
+    ns = faio__timers_timeout(&loop->timers, deadline);
+    events = loop->batch.events;
+    maxevents = loop->batch.size;
+    n = faio__kqueue_spin(loop, events, maxevents, ns);
+
+    if (n == 0) {
+      if (faio__asyncs_before_wait(&loop->asyncs))
+        ns = 0;
+
+      if (ns == -1)
+        pts = NULL;
+      else {
+        ts.tv_nsec = ns % 1000000000;
+        ts.tv_sec = ns / 1000000000;
+        pts = &ts;
+      }
 
-    if (n == 0)
-      return;
+      FAIO__STATS(faio__stats_wait_begin(&loop->stats));
+      FAIO__PROBE1(poll__begin, ns);
+      n = kevent(loop->kq, NULL, 0, events, maxevents, pts);
+      FAIO__PROBE1(poll__end, n);
+      FAIO__STATS(faio__stats_wait_end(&loop->stats, n, maxevents));
+      faio__asyncs_after_wait(&loop->asyncs);
 
-    if (n == -1) {
-      if (errno == EINTR)
-        goto update_timeout;
-      else
-        abort();
+      if (n == -1) {
+        if (errno != EINTR)
+          abort();
+
+        n = 0;
+      }
+
+      if (n > 0 && ns != 0)
+        loop->busy.block_wakeups++;
     }
 
+    FAIO__STATS(loop->stats.counters.events += n);
+
+    /* Sort the batch by priority before running any callbacks, one entry
+     * per handle. A callback that deletes a handle takes it off its list,
+     * the kevents that refer to it aren't looked at again.
+     */
+    faio__priority_init(ready);
+
     for (i = 0; i < n; i++) {
       handle = (struct faio_handle *) events[i].udata;
       revents = 0;
@@ -196,38 +315,70 @@ static void faio_poll(struct faio_loop *loop, double timeout)
       if (events[i].flags & EV_EOF)
         revents |= FAIO_POLLHUP;
 
-      handle->cb(loop, handle, revents);
+      /* The read and the write filter are separate kevents. */
+      if (!faio__queue_empty(&handle->batch_queue)) {
+        handle->batch_revents |= revents;
+        continue;
+      }
+
+      handle->batch_revents = revents;
+      faio__queue_append(&ready[handle->priority], &handle->batch_queue);
     }
 
-    /* We read as many events as we could but there might still be more.
-     * Poll again but don't block this time.
-     */
-    if (maxevents == (unsigned int) n) {
-      ts.tv_nsec = 0;
-      ts.tv_sec = 0;
-      pts = &ts;
-      continue;
+    for (prio = 0; prio < FAIO__PRIORITIES; prio++) {
+      while (!faio__queue_empty(&ready[prio])) {
+        queue = faio__queue_head(&ready[prio]);
+        handle = faio__queue_data(queue, struct faio_handle, batch_queue);
+        faio__queue_remove(queue);
+
+        /* Over budget. The filters are level-triggered, the kernel
+         * reports what's left again in the next call.
+         */
+        if (faio__budget_spent(&loop->budget)) {
+          FAIO__STATS(loop->stats.counters.budget_carryovers++);
+          continue;
+        }
+
+        revents = handle->batch_revents;
+        FAIO__STATS(loop->stats.counters.callbacks++);
+        FAIO__PROBE3(dispatch, handle->fd, revents, handle);
+        faio__watchdog_begin(&loop->watchdog, handle->fd, handle->cb);
+        handle->cb(loop, handle, revents);
+        FAIO__PROBE(dispatch__done);
+        faio__watchdog_end(loop, &loop->watchdog);
+        faio__budget_charge(&loop->budget);
+      }
     }
 
-    return;
+    faio__batch_update(&loop->batch, n);
 
-update_timeout:
-    if (pts == NULL)
-      continue;
+    if (faio__asyncs_run(loop, &loop->asyncs))
+      dispatched = 1;
 
-    if (ts.tv_sec == 0 && ts.tv_nsec == 0)
-      return;
+    faio__update_time(loop);
+    FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
 
-    if (faio__gettime_monotonic(&after))
-      abort();
+    if (faio__timers_run(loop, &loop->timers))
+      dispatched = 1;
 
-    FAIO_TIMESPEC_SUB(&after, &before, &diff);
-    FAIO_TIMESPEC_SUB(&ts, &diff, &ts);
+    /* We read as many events as we could but there might still be more.
+     * Poll again but don't block this time, budget permitting.
+     */
+    if (maxevents == (unsigned int) n &&
+        !faio__budget_spent(&loop->budget))
+    {
+      deadline = loop->timers.hrnow;
+      continue;
+    }
 
-    if (ts.tv_sec < 0)
+    if (n != 0 || dispatched)
       return;
 
-    before = after;
+    /* Interrupted by a signal or woke up early, poll again unless the
+     * timeout expired.
+     */
+    if (loop->timers.hrnow >= deadline)
+      return;
   }
 }
 
@@ -244,10 +395,13 @@ static int faio_add(struct faio_loop *loop,
   events |= POLLERR | POLLHUP;
 
   faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+  faio__queue_init(&handle->batch_queue);
   handle->cb = cb;
   handle->fd = fd;
   handle->events = events;
   handle->revents = 0;
+  handle->priority = FAIO_PRIORITY_NORMAL;
+  FAIO__PROBE3(add, fd, events, handle);
 
   return 0;
 }
@@ -261,6 +415,7 @@ static int faio_mod(struct faio_loop *loop,
   events |= POLLERR | POLLHUP;
   handle->revents = handle->events;
   handle->events = events;
+  FAIO__PROBE3(mod, handle->fd, events, handle);
 
   if (handle->events != handle->revents)
     if (faio__queue_empty(&handle->pending_queue))
@@ -275,12 +430,16 @@ static int faio_del(struct faio_loop *loop, struct faio_handle *handle)
   struct kevent events[2];
   int fd;
 
+  FAIO__PROBE2(del, handle->fd, handle);
   handle->revents = 0;
   handle->events = 0;
 
   if (!faio__queue_empty(&handle->pending_queue))
     faio__queue_remove(&handle->pending_queue);
 
+  if (!faio__queue_empty(&handle->batch_queue))
+    faio__queue_remove(&handle->batch_queue);
+
   fd = handle->fd;
   EV_SET(events + 0, fd, EVFILT_READ, EV_DELETE | EV_DISABLE, 0, 0, handle);
   EV_SET(events + 1, fd, EVFILT_WRITE, EV_DELETE | EV_DISABLE, 0, 0, handle);
@@ -288,4 +447,30 @@ static int faio_del(struct faio_loop *loop, struct faio_handle *handle)
   return kevent(loop->kq, events, 2, NULL, 0, NULL);
 }
 
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_busy_poll(struct faio_loop *loop, unsigned int usecs)
+{
+  loop->busy.usecs = usecs;
+  return 0;
+}
+
+/* Closing the file descriptor deletes its kevents. */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_close(struct faio_loop *loop, struct faio_handle *handle)
+{
+  (void) loop;
+
+  FAIO__PROBE2(del, handle->fd, handle);
+  handle->revents = 0;
+  handle->events = 0;
+
+  if (!faio__queue_empty(&handle->pending_queue))
+    faio__queue_remove(&handle->pending_queue);
+
+  if (!faio__queue_empty(&handle->batch_queue))
+    faio__queue_remove(&handle->batch_queue);
+
+  return close(handle->fd);
+}
+
 #endif /* FAIO_KQUEUE_H_ */
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Built on top of the backend primitives, like faio-common.h. Needs the
+ * backend's struct faio_handle.
+ */
+
+#ifndef FAIO_LISTENER_H_
+#define FAIO_LISTENER_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* Listeners accept at most |batch| connections per loop iteration. When
+ * there are more, the listener puts itself on the pending queue and picks
+ * up where it left off in the next iteration, so a flood of connection
+ * requests can't starve the connections that have already been accepted.
+ *
+ * Running out of file descriptors is the other way to stall a listener:
+ * the connections stay in the backlog and an edge-triggered backend won't
+ * report the listen socket again until yet another connection comes in.
+ * The listener keeps a spare descriptor around for that case. It closes
+ * it, accepts and closes the waiting connections and opens it again.
+ */
+#define FAIO_LISTEN_DEFER     1
+#define FAIO_LISTEN_EXCLUSIVE 2
+
+#define FAIO__LISTENER_BATCH  64
+
+struct faio_listener
+{
+  struct faio_handle handle;
+  void (*cb)(struct faio_loop *, struct faio_listener *, int);
+  unsigned int batch;
+  int spare_fd; /* Given up when accept() fails with EMFILE or ENFILE. */
+  int active;
+};
+
+static int faio__listener_spare(void)
+{
+#if defined(O_CLOEXEC)
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+#else
+  int fd;
+
+  fd = open("/dev/null", O_RDONLY);
+  if (fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  return fd;
+#endif
+}
+
+/* Returns a non-blocking, close-on-exec descriptor or -1. */
+static int faio__listener_accept(int fd)
+{
+  int peer;
+#if !defined(SYS_accept4) || !defined(SOCK_NONBLOCK)
+  int flags;
+#endif
+
+  do {
+#if defined(SYS_accept4) && defined(SOCK_NONBLOCK)
+    /* Not declared without _GNU_SOURCE. */
+    peer = syscall(SYS_accept4,
+                   fd,
+                   NULL,
+                   NULL,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    peer = accept(fd, NULL, NULL);
+#endif
+  }
+  while (peer == -1 && errno == EINTR);
+
+#if !defined(SYS_accept4) || !defined(SOCK_NONBLOCK)
+  if (peer == -1)
+    return -1;
+
+  flags = fcntl(peer, F_GETFL);
+
+  if (flags == -1 ||
+      fcntl(peer, F_SETFL, flags | O_NONBLOCK) ||
+      fcntl(peer, F_SETFD, FD_CLOEXEC))
+  {
+    close(peer);
+    return -1;
+  }
+#endif
+
+  return peer;
+}
+
+/* Make room with the spare descriptor and drop up to |max| waiting
+ * connections. Returns 1 if it stopped because of |max|.
+ */
+static int faio__listener_shed(struct faio_listener *l, unsigned int max)
+{
+  unsigned int n;
+  int fd;
+
+  close(l->spare_fd);
+
+  for (n = 0; n < max; n++) {
+    fd = faio__listener_accept(l->handle.fd);
+
+    if (fd == -1)
+      break;
+
+    close(fd);
+  }
+
+  /* Can fail when another thread grabbed the descriptor in the meantime.
+   * The listener can't shed connections anymore until it gets it back.
+   */
+  l->spare_fd = faio__listener_spare();
+
+  return n == max;
+}
+
+static void faio__listener_io(struct faio_loop *loop,
+                              struct faio_handle *handle,
+                              unsigned int revents)
+{
+  struct faio_listener *l;
+  unsigned int n;
+  int more;
+  int err;
+  int fd;
+
+  (void) revents;
+  l = faio__queue_data(handle, struct faio_listener, handle);
+
+  if (l->spare_fd == -1)
+    l->spare_fd = faio__listener_spare();
+
+  for (n = 0; n < l->batch; n++) {
+    fd = faio__listener_accept(handle->fd);
+
+    if (fd != -1) {
+      l->cb(loop, l, fd);
+
+      if (!l->active)
+        return;
+
+      continue;
+    }
+
+    err = errno;
+
+    if (err == EAGAIN || err == EWOULDBLOCK)
+      return;
+
+    /* The peer reset the connection before we got to it. */
+    if (err == ECONNABORTED)
+      continue;
+
+    more = 0;
+
+    if ((err == EMFILE || err == ENFILE) && l->spare_fd != -1)
+      more = faio__listener_shed(l, l->batch - n);
+
+    /* Anything else, like ENOBUFS, is retried when the next connection
+     * request comes in. Retrying right away would just spin.
+     */
+    l->cb(loop, l, -err);
+
+    if (!more || !l->active)
+      return;
+
+    break;
+  }
+
+  /* There may be more, come back in the next iteration. */
+  faio_mod(loop, handle, FAIO_POLLIN);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_listener_start(struct faio_loop *loop,
+                               struct faio_listener *listener,
+                               void (*cb)(struct faio_loop *loop,
+                                          struct faio_listener *listener,
+                                          int fd),
+                               int fd,
+                               unsigned int batch,
+                               unsigned int flags)
+{
+#if defined(TCP_DEFER_ACCEPT)
+  int secs;
+#endif
+
+  if (flags & ~(FAIO_LISTEN_DEFER | FAIO_LISTEN_EXCLUSIVE)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (flags & FAIO_LISTEN_DEFER) {
+#if defined(TCP_DEFER_ACCEPT)
+    /* The kernel turns it into a number of SYN-ACK retransmits. One is
+     * enough for clients that send their request right away.
+     */
+    secs = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)))
+      return -1;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+  }
+
+#if !defined(FAIO__EXCLUSIVE)
+  if (flags & FAIO_LISTEN_EXCLUSIVE) {
+    errno = ENOTSUP;
+    return -1;
+  }
+#endif
+
+  listener->spare_fd = faio__listener_spare();
+
+  if (listener->spare_fd == -1)
+    return -1;
+
+  if (faio_add(loop, &listener->handle, faio__listener_io, fd, FAIO_POLLIN)) {
+    close(listener->spare_fd);
+    return -1;
+  }
+
+#if defined(FAIO__EXCLUSIVE)
+  /* Only takes effect when the handle is registered with the kernel, and
+   * faio_add() defers that until the loop is about to block.
+   */
+  if (flags & FAIO_LISTEN_EXCLUSIVE)
+    faio__exclusive(&listener->handle);
+#endif
+
+  listener->cb = cb;
+  listener->batch = batch != 0 ? batch : FAIO__LISTENER_BATCH;
+  listener->active = 1;
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_listener_stop(struct faio_loop *loop,
+                               struct faio_listener *listener)
+{
+  if (!listener->active)
+    return;
+
+  listener->active = 0;
+  faio_del(loop, &listener->handle);
+
+  if (listener->spare_fd != -1)
+    close(listener->spare_fd);
+
+  listener->spare_fd = -1;
+}
+
+#endif /* FAIO_LISTENER_H_ */
@@ -18,8 +18,21 @@
 #define FAIO_PORT_H_
 
 #include "faio-util.h"
+#include "faio-timer.h"
+#include "faio-async.h"
+#include "faio-signal.h"
+#include "faio-batch.h"
+#include "faio-busy.h"
+#include "faio-budget.h"
+#include "faio-priority.h"
+#include "faio-stats.h"
+#include "faio-probes.h"
+#include "faio-watchdog.h"
+#include "faio-slab.h"
+#include "faio-writeq.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <poll.h>
@@ -32,20 +45,46 @@
 #define FAIO_POLLERR  POLLERR
 #define FAIO_POLLHUP  POLLHUP
 
-struct faio_loop
-{
-  struct faio__queue pending_queue;
-  int port_fd;
-};
-
 struct faio_handle
 {
   struct faio__queue pending_queue;
+  struct faio__queue batch_queue; /* Links the sorted batch. */
   void (*cb)(struct faio_loop *, struct faio_handle *, unsigned int);
   int events;
+  unsigned int revents; /* From the batch that's being dispatched. */
+  unsigned int priority;
   int fd;
 };
 
+struct faio_loop
+{
+  struct faio__queue pending_queue;
+  struct faio__timers timers;
+  struct faio__asyncs asyncs;
+  struct faio_handle async_handle;
+  struct faio__signals signals;
+  struct faio_handle signal_handle;
+  struct faio__batch batch;
+  struct faio__busy busy;
+  struct faio__budget budget;
+  struct faio__watchdog watchdog;
+  struct faio__queue slabs;
+#if defined(FAIO_STATS)
+  struct faio__stats stats;
+#endif
+  int port_fd;
+};
+
+static void faio__update_time(struct faio_loop *loop)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  faio__timers_update(&loop->timers, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
 FAIO_ATTRIBUTE_UNUSED
 static int faio_init(struct faio_loop *loop)
 {
@@ -54,8 +93,22 @@ static int faio_init(struct faio_loop *loop)
   if (-1 == (port_fd = port_create()))
     return -1;
 
+  if (faio__batch_init(&loop->batch, sizeof(struct port_event))) {
+    close(port_fd);
+    return -1;
+  }
+
   loop->port_fd = port_fd;
   faio__queue_init(&loop->pending_queue);
+  faio__update_time(loop);
+  faio__timers_init(&loop->timers, loop->timers.now);
+  faio__asyncs_init(&loop->asyncs);
+  faio__signals_init(&loop->signals);
+  faio__busy_init(&loop->busy);
+  faio__budget_init(&loop->budget);
+  faio__watchdog_init(&loop->watchdog);
+  faio__queue_init(&loop->slabs);
+  FAIO__STATS(faio__stats_init(&loop->stats));
 
   return 0;
 }
@@ -63,24 +116,80 @@ static int faio_init(struct faio_loop *loop)
 FAIO_ATTRIBUTE_UNUSED
 static void faio_fini(struct faio_loop *loop)
 {
+  faio__asyncs_fini(&loop->asyncs);
+  faio__signals_fini(&loop->signals);
+  faio__batch_fini(&loop->batch);
+  faio__slabs_fini(&loop->slabs);
   close(loop->port_fd);
   loop->port_fd = -1;
 }
 
+/* Dispatch a batch, highest priority first. Every handle goes on the
+ * pending queue to be associated again, dispatched or not. The batch is
+ * sorted before any callbacks run; a callback that deletes a handle takes
+ * it off both lists and its event isn't looked at again.
+ */
+static void faio__port_dispatch(struct faio_loop *loop,
+                                struct port_event *events,
+                                unsigned int nevents)
+{
+  struct faio__queue ready[FAIO__PRIORITIES];
+  struct faio_handle *handle;
+  struct faio__queue *queue;
+  unsigned int prio;
+  unsigned int i;
+
+  faio__priority_init(ready);
+
+  /* One event per handle, the association is gone once it fires. */
+  for (i = 0; i < nevents; i++) {
+    handle = (struct faio_handle *) events[i].portev_user;
+    handle->revents = events[i].portev_events;
+
+    if (faio__queue_empty(&handle->pending_queue))
+      faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+
+    faio__queue_append(&ready[handle->priority], &handle->batch_queue);
+  }
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++) {
+    while (!faio__queue_empty(&ready[prio])) {
+      queue = faio__queue_head(&ready[prio]);
+      handle = faio__queue_data(queue, struct faio_handle, batch_queue);
+      faio__queue_remove(queue);
+
+      /* Over budget. The kernel reports it again after the next call
+       * associates it again, if it's still ready.
+       */
+      if (faio__budget_spent(&loop->budget)) {
+        FAIO__STATS(loop->stats.counters.budget_carryovers++);
+        continue;
+      }
+
+      FAIO__STATS(loop->stats.counters.callbacks++);
+      FAIO__PROBE3(dispatch, handle->fd, handle->revents, handle);
+      faio__watchdog_begin(&loop->watchdog, handle->fd, handle->cb);
+      handle->cb(loop, handle, handle->revents);
+      FAIO__PROBE(dispatch__done);
+      faio__watchdog_end(loop, &loop->watchdog);
+      faio__budget_charge(&loop->budget);
+    }
+  }
+}
+
 FAIO_ATTRIBUTE_UNUSED
 static unsigned int faio__port_poll_nb(struct faio_loop *loop)
 {
-  struct port_event events[256];
-  struct faio_handle *handle;
+  struct port_event *events;
   struct timespec timeout;
   unsigned int maxevents;
   unsigned int nevents;
-  unsigned int i;
 
   timeout.tv_sec = 0;
   timeout.tv_nsec = 0;
 
-  maxevents = sizeof(events) / sizeof(events[0]);
+  events = loop->batch.events;
+  maxevents = loop->batch.size;
   nevents = maxevents;
 
   /* Work around kernel bug where nevents is not updated. */
@@ -91,16 +200,18 @@ static unsigned int faio__port_poll_nb(struct faio_loop *loop)
       abort();
 
   if (events[0].portev_source == 0)
-    return 0;
+    nevents = 0;
 
-  for (i = 0; i < nevents; i++) {
-    handle = (struct faio_handle *) events[i].portev_user;
+  FAIO__STATS(faio__stats_poll(&loop->stats, nevents, maxevents));
 
-    if (faio__queue_empty(&handle->pending_queue))
-      faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+  if (nevents == 0)
+    return 0;
 
-    handle->cb(loop, handle, events[i].portev_events);
-  }
+  FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
+  FAIO__STATS(loop->stats.counters.events += nevents);
+
+  faio__port_dispatch(loop, events, nevents);
+  faio__batch_update(&loop->batch, nevents);
 
   return nevents;
 }
@@ -108,14 +219,12 @@ static unsigned int faio__port_poll_nb(struct faio_loop *loop)
 FAIO_ATTRIBUTE_UNUSED
 static void faio__port_poll(struct faio_loop *loop, struct timespec *timeout)
 {
-  struct port_event events[256];
-  struct faio_handle *handle;
+  struct port_event *events;
   struct timespec before;
   struct timespec after;
   struct timespec diff;
   unsigned int maxevents;
   unsigned int nevents;
-  unsigned int i;
   int saved_errno;
 
   /* Try a non-blocking poll first. If it fetches events, good - we can
@@ -128,12 +237,18 @@ static void faio__port_poll(struct faio_loop *loop, struct timespec *timeout)
     abort();
 
   for (;;) {
-    maxevents = sizeof(events) / sizeof(events[0]);
+    events = loop->batch.events;
+    maxevents = loop->batch.size;
     nevents = 1;
 
     /* Work around kernel bug where nevents is not updated. */
     events[0].portev_source = 0;
 
+    FAIO__STATS(faio__stats_wait_begin(&loop->stats));
+    FAIO__PROBE1(poll__begin,
+                 timeout == NULL ? -1 :
+                 timeout->tv_sec * 1000000000LL + timeout->tv_nsec);
+
     if (port_getn(loop->port_fd, events, maxevents, &nevents, timeout) == 0)
       saved_errno = 0;
     else if (errno == EINTR || errno == ETIME)
@@ -141,20 +256,25 @@ static void faio__port_poll(struct faio_loop *loop, struct timespec *timeout)
     else
       abort();
 
+    FAIO__PROBE1(poll__end, nevents);
+
     if (events[0].portev_source == 0)
-      return;
+      nevents = 0;
 
-    for (i = 0; i < nevents; i++) {
-      handle = (struct faio_handle *) events[i].portev_user;
+    FAIO__STATS(faio__stats_wait_end(&loop->stats, nevents, maxevents));
 
-      if (faio__queue_empty(&handle->pending_queue))
-        faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+    if (nevents == 0)
+      return;
 
-      handle->cb(loop, handle, events[i].portev_events);
-    }
+    FAIO__STATS(loop->stats.counters.events += nevents);
+
+    faio__port_dispatch(loop, events, nevents);
+    faio__batch_update(&loop->batch, nevents);
 
-    if (nevents > 0)
+    if (nevents > 0) {
+      loop->busy.block_wakeups++;
       return;
+    }
 
     if (saved_errno == ETIME)
       return;
@@ -176,11 +296,42 @@ static void faio__port_poll(struct faio_loop *loop, struct timespec *timeout)
   }
 }
 
+/* Poll without blocking until there are events or the busy poll budget
+ * runs out. Returns the number of events that were dispatched.
+ */
+static unsigned int faio__port_spin(struct faio_loop *loop, int64_t ns)
+{
+  unsigned int n;
+  uint64_t stop;
+
+  stop = faio__busy_deadline(&loop->busy, ns);
+
+  if (stop == 0)
+    return 0;
+
+  do {
+    n = faio__port_poll_nb(loop);
+
+    if (n > 0 || faio__asyncs_pending(&loop->asyncs)) {
+      loop->busy.spin_wakeups++;
+      return n;
+    }
+  }
+  while (faio__busy_hrtime() < stop);
+
+  return 0;
+}
+
 FAIO_ATTRIBUTE_UNUSED
-static void faio_poll(struct faio_loop *loop, double timeout)
+static void faio_poll_ns(struct faio_loop *loop, int64_t timeout)
 {
   struct faio_handle *handle;
   struct faio__queue *queue;
+  struct timespec ts;
+  uint64_t deadline;
+  int64_t ns;
+
+  faio__budget_begin(&loop->budget);
 
   while (!faio__queue_empty(&loop->pending_queue)) {
     queue = faio__queue_head(&loop->pending_queue);
@@ -193,16 +344,38 @@ static void faio_poll(struct faio_loop *loop, double timeout)
                    handle);
   }
 
-  if (timeout == 0)
-    faio__port_poll_nb(loop);
-  else if (timeout < 0)
-    faio__port_poll(loop, NULL);
-  else {
-    struct timespec ts;
-    ts.tv_nsec = (unsigned long) (timeout * 1e9) % 1000000000UL;
-    ts.tv_sec = (unsigned long) timeout;
-    faio__port_poll(loop, &ts);
+  faio__update_time(loop);
+
+  if (faio__timers_run(loop, &loop->timers))
+    timeout = 0;
+
+  if (timeout < 0)
+    deadline = UINT64_MAX;
+  else
+    deadline = loop->timers.hrnow + timeout;
+
+  ns = faio__timers_timeout(&loop->timers, deadline);
+
+  if (faio__port_spin(loop, ns) == 0) {
+    if (faio__asyncs_before_wait(&loop->asyncs))
+      ns = 0;
+
+    if (ns == 0)
+      faio__port_poll_nb(loop);
+    else if (ns < 0)
+      faio__port_poll(loop, NULL);
+    else {
+      ts.tv_nsec = ns % 1000000000;
+      ts.tv_sec = ns / 1000000000;
+      faio__port_poll(loop, &ts);
+    }
+
+    faio__asyncs_after_wait(&loop->asyncs);
   }
+  faio__asyncs_run(loop, &loop->asyncs);
+  faio__update_time(loop);
+  FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
+  faio__timers_run(loop, &loop->timers);
 }
 
 FAIO_ATTRIBUTE_UNUSED
@@ -218,9 +391,12 @@ static int faio_add(struct faio_loop *loop,
   events |= POLLERR | POLLHUP;
 
   faio__queue_append(&loop->pending_queue, &handle->pending_queue);
+  faio__queue_init(&handle->batch_queue);
   handle->cb = cb;
   handle->fd = fd;
   handle->events = events;
+  handle->priority = FAIO_PRIORITY_NORMAL;
+  FAIO__PROBE3(add, fd, events, handle);
 
   return 0;
 }
@@ -233,6 +409,7 @@ static int faio_mod(struct faio_loop *loop,
   events &= POLLIN | POLLOUT;
   events |= POLLERR | POLLHUP;
   handle->events = events;
+  FAIO__PROBE3(mod, handle->fd, events, handle);
 
   if (faio__queue_empty(&handle->pending_queue))
     faio__queue_append(&loop->pending_queue, &handle->pending_queue);
@@ -243,12 +420,41 @@ static int faio_mod(struct faio_loop *loop,
 FAIO_ATTRIBUTE_UNUSED
 static int faio_del(struct faio_loop *loop, struct faio_handle *handle)
 {
+  FAIO__PROBE2(del, handle->fd, handle);
   handle->events = 0;
 
   if (!faio__queue_empty(&handle->pending_queue))
     faio__queue_remove(&handle->pending_queue);
 
+  if (!faio__queue_empty(&handle->batch_queue))
+    faio__queue_remove(&handle->batch_queue);
+
   return port_dissociate(loop->port_fd, PORT_SOURCE_FD, handle->fd);
 }
 
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_busy_poll(struct faio_loop *loop, unsigned int usecs)
+{
+  loop->busy.usecs = usecs;
+  return 0;
+}
+
+/* Closing the file descriptor dissociates it from the port. */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_close(struct faio_loop *loop, struct faio_handle *handle)
+{
+  (void) loop;
+
+  FAIO__PROBE2(del, handle->fd, handle);
+  handle->events = 0;
+
+  if (!faio__queue_empty(&handle->pending_queue))
+    faio__queue_remove(&handle->pending_queue);
+
+  if (!faio__queue_empty(&handle->batch_queue))
+    faio__queue_remove(&handle->batch_queue);
+
+  return close(handle->fd);
+}
+
 #endif /* FAIO_PORT_H_ */
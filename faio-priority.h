@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_PRIORITY_H_
+#define FAIO_PRIORITY_H_
+
+#include "faio-util.h"
+
+/* Handle priorities. When several handles are ready at once, the loop
+ * dispatches the high priority ones first, then the normal ones, then the
+ * low ones. Together with a dispatch budget that keeps control traffic,
+ * like the listen socket or a health check, responsive while the bulk
+ * connections saturate the loop.
+ *
+ * The edge-triggered backends keep one pending queue per priority and
+ * sort every batch into one list per priority, linked through the same
+ * queue member of the handle. That's an append per event, the order
+ * within a priority is the order in which the kernel reported them.
+ */
+#define FAIO_PRIORITY_HIGH    0
+#define FAIO_PRIORITY_NORMAL  1
+#define FAIO_PRIORITY_LOW     2
+
+#define FAIO__PRIORITIES      3
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__priority_init(struct faio__queue *queues)
+{
+  unsigned int prio;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    faio__queue_init(&queues[prio]);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__priority_empty(const struct faio__queue *queues)
+{
+  unsigned int prio;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    if (!faio__queue_empty(&queues[prio]))
+      return 0;
+
+  return 1;
+}
+
+/* Moves every queue in |h| to the same queue in |n|, leaving |h| empty. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__priority_move(struct faio__queue *h, struct faio__queue *n)
+{
+  unsigned int prio;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    faio__queue_move(&h[prio], &n[prio]);
+}
+
+/* Like faio__priority_move() but to the front of the queues in |n|. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__priority_prepend(struct faio__queue *h,
+                                   struct faio__queue *n)
+{
+  unsigned int prio;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    faio__queue_prepend(&h[prio], &n[prio]);
+}
+
+/* Like faio__priority_move() but to the back of the queues in |n|. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__priority_concat(struct faio__queue *h,
+                                  struct faio__queue *n)
+{
+  unsigned int prio;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    faio__queue_concat(&h[prio], &n[prio]);
+}
+
+#endif /* FAIO_PRIORITY_H_ */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_PROBES_H_
+#define FAIO_PROBES_H_
+
+/* Static tracepoints for bpftrace, perf and friends. Compile with
+ * FAIO_USDT defined to enable them, that requires <sys/sdt.h> from
+ * SystemTap. Enabled probes compile to a single nop until a tracer
+ * attaches. All probes belong to the "faio" provider:
+ *
+ *   poll__begin(timeout_ns)      About to wait for events.
+ *   poll__end(nevents)           Done waiting.
+ *   dispatch(fd, revents, h)     About to invoke the callback of handle h.
+ *   dispatch__done()             Callback returned. h may be gone now.
+ *   replay(fd, revents, h)       Same as dispatch but from the pending
+ *                                queue, followed by dispatch__done().
+ *   add(fd, events, h)           faio_add()
+ *   mod(fd, events, h)           faio_mod()
+ *   del(fd, h)                   faio_del() and faio_close()
+ *
+ * Without FAIO_USDT the probes and their arguments vanish.
+ */
+#if defined(FAIO_USDT)
+#include <sys/sdt.h>
+#define FAIO__PROBE(name) DTRACE_PROBE(faio, name)
+#define FAIO__PROBE1(name, a) DTRACE_PROBE1(faio, name, a)
+#define FAIO__PROBE2(name, a, b) DTRACE_PROBE2(faio, name, a, b)
+#define FAIO__PROBE3(name, a, b, c) DTRACE_PROBE3(faio, name, a, b, c)
+#else
+#define FAIO__PROBE(name) ((void) 0)
+#define FAIO__PROBE1(name, a) ((void) 0)
+#define FAIO__PROBE2(name, a, b) ((void) 0)
+#define FAIO__PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif /* FAIO_PROBES_H_ */
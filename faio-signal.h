@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_SIGNAL_H_
+#define FAIO_SIGNAL_H_
+
+#include "faio-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#endif
+
+/* Signal handles. All signal handles of a loop share one signalfd whose
+ * mask is the union of the watched signals. The signals are blocked so
+ * they are only delivered through the signalfd; do that before any other
+ * threads are started or block them in those threads too.
+ *
+ * Other platforms use a self-pipe. The signal handler has no way of
+ * knowing what loop it belongs to so only one loop per process can watch
+ * signals there.
+ */
+struct faio_signal
+{
+  struct faio__queue queue;
+  void (*cb)(struct faio_loop *, struct faio_signal *, int);
+  int signum;
+};
+
+struct faio__signals
+{
+  struct faio__queue queue; /* All active struct faio_signal handles. */
+  struct faio__queue *dispatching; /* Handles not yet visited, or NULL. */
+  sigset_t mask;            /* Signals that are being watched. */
+  int fds[2];               /* Same fd twice if it's a signalfd. */
+};
+
+#if !defined(__linux__)
+static int faio__signals_wfd = -1;
+
+static void faio__signals_handler(int signum)
+{
+  unsigned char c;
+  int saved_errno;
+
+  saved_errno = errno;
+  c = signum;
+
+  while (write(faio__signals_wfd, &c, 1) == -1 && errno == EINTR);
+
+  errno = saved_errno;
+}
+#endif
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__signals_init(struct faio__signals *s)
+{
+  faio__queue_init(&s->queue);
+  s->dispatching = NULL;
+  sigemptyset(&s->mask);
+  s->fds[0] = -1;
+  s->fds[1] = -1;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__signals_open(struct faio__signals *s)
+{
+  int fd;
+
+#if defined(__linux__)
+  fd = signalfd(-1, &s->mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+  if (fd == -1)
+    return -1;
+
+  s->fds[0] = fd;
+  s->fds[1] = fd;
+#else
+  if (faio__signals_wfd != -1) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (pipe(s->fds))
+    return -1;
+
+  for (fd = 0; fd < 2; fd++) {
+    fcntl(s->fds[fd], F_SETFD, FD_CLOEXEC);
+    fcntl(s->fds[fd], F_SETFL, fcntl(s->fds[fd], F_GETFL) | O_NONBLOCK);
+  }
+
+  faio__signals_wfd = s->fds[1];
+#endif
+
+  return 0;
+}
+
+/* Start delivering |signum| to the loop. */
+static int faio__signals_watch(struct faio__signals *s, int signum)
+{
+#if defined(__linux__)
+  sigset_t set;
+#else
+  struct sigaction sa;
+#endif
+
+  if (sigismember(&s->mask, signum) == 1)
+    return 0;
+
+#if defined(__linux__)
+  if (sigaddset(&s->mask, signum))
+    return -1;
+
+  /* Update the signalfd first, a signal that arrives in between is still
+   * pending when it's blocked.
+   */
+  if (signalfd(s->fds[0], &s->mask, 0) == -1) {
+    sigdelset(&s->mask, signum);
+    return -1;
+  }
+
+  sigemptyset(&set);
+  sigaddset(&set, signum);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+#else
+  memset(&sa, 0, sizeof(sa));
+  sigfillset(&sa.sa_mask);
+  sa.sa_handler = faio__signals_handler;
+  sa.sa_flags = SA_RESTART;
+
+  if (sigaction(signum, &sa, NULL))
+    return -1;
+
+  sigaddset(&s->mask, signum);
+#endif
+
+  return 0;
+}
+
+/* Returns 1 if an active handle watches |signum|, including the ones that
+ * faio__signals_dispatch() has yet to visit.
+ */
+static int faio__signals_watched(struct faio__signals *s, int signum)
+{
+  struct faio_signal *sig;
+  struct faio__queue *queue;
+
+  for (queue = faio__queue_head(&s->queue);
+       queue != &s->queue;
+       queue = queue->next)
+  {
+    sig = faio__queue_data(queue, struct faio_signal, queue);
+
+    if (sig->signum == signum)
+      return 1;
+  }
+
+  if (s->dispatching == NULL)
+    return 0;
+
+  for (queue = faio__queue_head(s->dispatching);
+       queue != s->dispatching;
+       queue = queue->next)
+  {
+    sig = faio__queue_data(queue, struct faio_signal, queue);
+
+    if (sig->signum == signum)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Stop delivering |signum| to the loop and restore the default action. */
+static void faio__signals_unwatch(struct faio__signals *s, int signum)
+{
+#if defined(__linux__)
+  sigset_t set;
+#endif
+
+  if (sigismember(&s->mask, signum) != 1)
+    return;
+
+  sigdelset(&s->mask, signum);
+
+#if defined(__linux__)
+  signalfd(s->fds[0], &s->mask, 0);
+  sigemptyset(&set);
+  sigaddset(&set, signum);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+#else
+  signal(signum, SIG_DFL);
+#endif
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__signals_fini(struct faio__signals *s)
+{
+  int signum;
+
+  for (signum = 1; signum < NSIG; signum++)
+    faio__signals_unwatch(s, signum);
+
+  if (s->fds[0] != -1)
+    close(s->fds[0]);
+
+  if (s->fds[1] != -1 && s->fds[1] != s->fds[0])
+    close(s->fds[1]);
+
+#if !defined(__linux__)
+  if (faio__signals_wfd == s->fds[1])
+    faio__signals_wfd = -1;
+#endif
+
+  s->fds[0] = -1;
+  s->fds[1] = -1;
+}
+
+/* Invoke the callbacks of the handles that watch |signum|. */
+static void faio__signals_dispatch(struct faio_loop *loop,
+                                   struct faio__signals *s,
+                                   int signum)
+{
+  struct faio_signal *sig;
+  struct faio__queue *queue;
+  struct faio__queue list;
+
+  /* Callbacks may stop handles, including ones we haven't visited yet.
+   * Walk a detached list and put handles back as we go.
+   */
+  faio__queue_move(&s->queue, &list);
+  s->dispatching = &list;
+
+  while (!faio__queue_empty(&list)) {
+    queue = faio__queue_head(&list);
+    faio__queue_remove(queue);
+    faio__queue_append(&s->queue, queue);
+    sig = faio__queue_data(queue, struct faio_signal, queue);
+
+    if (sig->signum == signum)
+      sig->cb(loop, sig, signum);
+  }
+
+  s->dispatching = NULL;
+}
+
+/* Called by the loop when the signalfd or pipe is readable. Reads as many
+ * signals per syscall as will fit in the buffer.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__signals_run(struct faio_loop *loop, struct faio__signals *s)
+{
+#if defined(__linux__)
+  struct signalfd_siginfo buf[16];
+#else
+  unsigned char buf[64];
+#endif
+  ssize_t n;
+  size_t i;
+
+  for (;;) {
+    n = read(s->fds[0], buf, sizeof(buf));
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    for (i = 0; i < n / sizeof(buf[0]); i++)
+#if defined(__linux__)
+      faio__signals_dispatch(loop, s, buf[i].ssi_signo);
+#else
+      faio__signals_dispatch(loop, s, buf[i]);
+#endif
+
+    if ((size_t) n < sizeof(buf))
+      break;
+  }
+}
+
+#endif /* FAIO_SIGNAL_H_ */
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef FAIO_SLAB_H_
+#define FAIO_SLAB_H_
+
+#include "faio-util.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Handle IDs. Backends that can store a 64-bit value with each kernel
+ * event store a slot index and the slot's generation instead of a raw
+ * struct faio_handle pointer. Deleting a handle bumps the generation, so
+ * events for it that are still in the batch that's being dispatched no
+ * longer match their slot and are dropped without scanning the batch.
+ * Freed slots are reused in LIFO order. Generations are 31 bits wide, so
+ * the top bit of an ID is always clear and backends can shift it left to
+ * make room for a tag bit.
+ */
+#define FAIO__SLOT_GEN_MASK 0x7fffffffu
+
+#define FAIO__SLOT_NONE ((uint32_t) -1)
+
+struct faio__slot
+{
+  struct faio_handle *handle; /* NULL if free. */
+  uint32_t gen;
+  uint32_t next;              /* Next free slot. */
+};
+
+struct faio__slots
+{
+  struct faio__slot *slots;
+  uint32_t size;
+  uint32_t used; /* Slots that have ever been handed out. */
+  uint32_t free; /* Head of the free list. */
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__slots_init(struct faio__slots *s)
+{
+  s->slots = NULL;
+  s->size = 0;
+  s->used = 0;
+  s->free = FAIO__SLOT_NONE;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__slots_fini(struct faio__slots *s)
+{
+  free(s->slots);
+  faio__slots_init(s);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__slots_alloc(struct faio__slots *s,
+                             struct faio_handle *handle,
+                             uint64_t *id)
+{
+  struct faio__slot *slots;
+  uint32_t index;
+  uint32_t size;
+
+  if (s->free != FAIO__SLOT_NONE) {
+    index = s->free;
+    s->free = s->slots[index].next;
+  }
+  else {
+    if (s->used == s->size) {
+      size = s->size ? s->size * 2 : 64;
+
+      /* FAIO__SLOT_NONE is never a valid index. */
+      if (size <= s->size || size == FAIO__SLOT_NONE) {
+        errno = ENOMEM;
+        return -1;
+      }
+
+      slots = realloc(s->slots, size * sizeof(*slots));
+
+      if (slots == NULL)
+        return -1;
+
+      s->slots = slots;
+      s->size = size;
+    }
+
+    index = s->used++;
+    s->slots[index].gen = 0;
+  }
+
+  s->slots[index].handle = handle;
+  *id = (uint64_t) s->slots[index].gen << 32 | index;
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__slots_free(struct faio__slots *s, uint64_t id)
+{
+  struct faio__slot *slot;
+
+  slot = s->slots + (uint32_t) id;
+  slot->handle = NULL;
+  slot->gen = (slot->gen + 1) & FAIO__SLOT_GEN_MASK;
+  slot->next = s->free;
+  s->free = (uint32_t) id;
+}
+
+/* Returns the handle that |id| refers to or NULL if it has been deleted
+ * since. IDs with an out of range index, like (uint64_t) -1, are never
+ * valid.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static struct faio_handle *faio__slots_get(const struct faio__slots *s,
+                                           uint64_t id)
+{
+  const struct faio__slot *slot;
+
+  if ((uint32_t) id >= s->used)
+    return NULL;
+
+  slot = s->slots + (uint32_t) id;
+
+  if (slot->gen != (uint32_t) (id >> 32))
+    return NULL;
+
+  return slot->handle;
+}
+
+/* Fixed-size object allocator for structs that embed a struct
+ * faio_handle, see faio_slab_init(). Objects are carved out of 2 MB
+ * chunks that are backed by huge pages where the system has them to
+ * spare. Freed objects go on a free list and are handed out again before
+ * a new chunk is mapped; chunks are only returned to the system by
+ * faio_slab_fini().
+ */
+#define FAIO__SLAB_CHUNK (2 << 20)
+#define FAIO__SLAB_ALIGN 16
+
+struct faio__slab_chunk
+{
+  struct faio__slab_chunk *next;
+};
+
+struct faio_slab
+{
+  struct faio__queue queue; /* In the loop's list of slabs. */
+  struct faio__slab_chunk *chunks;
+  void *free;               /* Free list, threaded through the objects. */
+  size_t size;              /* Object size, rounded up. */
+  size_t offset;            /* Of the first object in a chunk. */
+  size_t count;             /* Objects per chunk. */
+};
+
+static void *faio__slab_map(size_t size)
+{
+  void *p;
+
+#if defined(MAP_HUGETLB)
+  /* Fails when no huge pages are reserved or the default huge page size
+   * isn't 2 MB. Fall back to transparent huge pages.
+   */
+  p = mmap(NULL,
+           size,
+           PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON | MAP_HUGETLB,
+           -1,
+           0);
+
+  if (p != MAP_FAILED)
+    return p;
+#endif
+
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+  if (p == MAP_FAILED)
+    return NULL;
+
+#if defined(MADV_HUGEPAGE)
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+  return p;
+}
+
+/* Maps a new chunk and puts its objects on the free list, lowest address
+ * first. |touch| pre-faults the whole chunk.
+ */
+static int faio__slab_grow(struct faio_slab *slab, int touch)
+{
+  struct faio__slab_chunk *chunk;
+  char *base;
+  size_t i;
+
+  chunk = faio__slab_map(FAIO__SLAB_CHUNK);
+
+  if (chunk == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (touch)
+    memset(chunk, 0, FAIO__SLAB_CHUNK);
+
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  base = (char *) chunk + slab->offset;
+
+  for (i = slab->count; i > 0; i--) {
+    *(void **) (base + (i - 1) * slab->size) = slab->free;
+    slab->free = base + (i - 1) * slab->size;
+  }
+
+  return 0;
+}
+
+/* Releases all memory, including objects that haven't been freed. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_slab_fini(struct faio_slab *slab)
+{
+  struct faio__slab_chunk *chunk;
+
+  if (!faio__queue_empty(&slab->queue))
+    faio__queue_remove(&slab->queue);
+
+  while (slab->chunks != NULL) {
+    chunk = slab->chunks;
+    slab->chunks = chunk->next;
+    munmap(chunk, FAIO__SLAB_CHUNK);
+  }
+
+  slab->free = NULL;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio__slab_init(struct faio_slab *slab,
+                           size_t size,
+                           unsigned int prewarm)
+{
+  size_t count;
+
+  if (size < sizeof(void *))
+    size = sizeof(void *);
+
+  size = (size + FAIO__SLAB_ALIGN - 1) & ~(size_t) (FAIO__SLAB_ALIGN - 1);
+  slab->offset = (sizeof(struct faio__slab_chunk) + FAIO__SLAB_ALIGN - 1) &
+                 ~(size_t) (FAIO__SLAB_ALIGN - 1);
+
+  if (size > FAIO__SLAB_CHUNK - slab->offset) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  faio__queue_init(&slab->queue);
+  slab->chunks = NULL;
+  slab->free = NULL;
+  slab->size = size;
+  slab->count = (FAIO__SLAB_CHUNK - slab->offset) / size;
+
+  for (count = 0; count < prewarm; count += slab->count) {
+    if (faio__slab_grow(slab, 1)) {
+      faio_slab_fini(slab);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Returns an uninitialized object or NULL if out of memory. */
+FAIO_ATTRIBUTE_UNUSED
+static void *faio_slab_alloc(struct faio_slab *slab)
+{
+  void *p;
+
+  if (slab->free == NULL)
+    if (faio__slab_grow(slab, 0))
+      return NULL;
+
+  p = slab->free;
+  slab->free = *(void **) p;
+
+  return p;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_slab_free(struct faio_slab *slab, void *p)
+{
+  *(void **) p = slab->free;
+  slab->free = p;
+}
+
+/* Called by faio_fini() for the slabs that are still alive. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__slabs_fini(struct faio__queue *slabs)
+{
+  while (!faio__queue_empty(slabs))
+    faio_slab_fini(faio__queue_data(faio__queue_head(slabs),
+                                    struct faio_slab,
+                                    queue));
+}
+
+#endif /* FAIO_SLAB_H_ */
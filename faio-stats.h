@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_STATS_H_
+#define FAIO_STATS_H_
+
+#include "faio-busy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Loop statistics, only compiled in when FAIO_STATS is defined. Backends
+ * wrap every update in FAIO__STATS() so that they vanish otherwise.
+ * Timestamps are taken around the wait, the time in between two waits
+ * is attributed to callbacks.
+ */
+#if defined(FAIO_STATS)
+#define FAIO__STATS(expr) (expr)
+#else
+#define FAIO__STATS(expr) ((void) 0)
+#endif
+
+struct faio__stats
+{
+  struct faio_stats counters;
+  uint64_t mark; /* Start of the current wait or dispatch phase. */
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_init(struct faio__stats *st)
+{
+  memset(&st->counters, 0, sizeof(st->counters));
+  st->mark = 0;
+}
+
+/* Count a call into the kernel after which |n| events were ready. The
+ * events themselves are counted when they are dispatched.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_poll(struct faio__stats *st,
+                             int n,
+                             unsigned int maxevents)
+{
+  st->counters.polls++;
+
+  if (n <= 0)
+    st->counters.polls_empty++;
+  else if ((unsigned int) n >= maxevents)
+    st->counters.polls_full++;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_wait_begin(struct faio__stats *st)
+{
+  st->mark = faio__busy_hrtime();
+}
+
+/* Also starts the dispatch phase. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_wait_end(struct faio__stats *st,
+                                 int n,
+                                 unsigned int maxevents)
+{
+  uint64_t now;
+
+  now = faio__busy_hrtime();
+  st->counters.blocked_ns += now - st->mark;
+  st->mark = now;
+  faio__stats_poll(st, n, maxevents);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_dispatch_begin(struct faio__stats *st)
+{
+  st->mark = faio__busy_hrtime();
+}
+
+/* |now| is the loop time in nanoseconds, the caller just updated it. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__stats_dispatch_end(struct faio__stats *st, uint64_t now)
+{
+  if (now > st->mark)
+    st->counters.callback_ns += now - st->mark;
+}
+
+#endif /* FAIO_STATS_H_ */
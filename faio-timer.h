@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_TIMER_H_
+#define FAIO_TIMER_H_
+
+#include "faio-util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hierarchical timing wheel with millisecond ticks. Level 0 has one slot
+ * per tick, every next level has slots that are FAIO__TIMER_SLOTS times
+ * coarser. Timers in the higher levels are cascaded down when the wheel
+ * reaches their slot. Starting, restarting and stopping a timer are O(1)
+ * list operations and never allocate.
+ *
+ * Four levels of 64 slots cover 2^24 ms, about 4.6 hours. Timers that are
+ * further out are parked in the last slot and re-inserted when it expires.
+ * The number of slots must match the width of the occupancy bitmaps.
+ */
+#define FAIO__TIMER_BITS    6
+#define FAIO__TIMER_SLOTS   (1 << FAIO__TIMER_BITS)
+#define FAIO__TIMER_MASK    (FAIO__TIMER_SLOTS - 1)
+#define FAIO__TIMER_LEVELS  4
+
+struct faio_timer
+{
+  struct faio__queue queue;
+  void (*cb)(struct faio_loop *, struct faio_timer *);
+  uint64_t deadline; /* In loop time, milliseconds. */
+};
+
+struct faio__timers
+{
+  struct faio__queue slots[FAIO__TIMER_LEVELS][FAIO__TIMER_SLOTS];
+  uint64_t occupied[FAIO__TIMER_LEVELS]; /* Lazily cleared, see _next(). */
+  uint64_t current; /* Next tick to process. */
+  uint64_t now;     /* Loop time, updated once per loop iteration. */
+  uint64_t hrnow;   /* Same but in nanoseconds. */
+};
+
+static unsigned int faio__timers_ctz(uint64_t bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  unsigned int n;
+
+  for (n = 0; (bits & 1) == 0; n++)
+    bits >>= 1;
+
+  return n;
+#endif
+}
+
+/* Sets the loop time. |hrnow| is in nanoseconds. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__timers_update(struct faio__timers *t, uint64_t hrnow)
+{
+  t->hrnow = hrnow;
+  t->now = hrnow / 1000000;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__timers_init(struct faio__timers *t, uint64_t now)
+{
+  unsigned int level;
+  unsigned int slot;
+
+  for (level = 0; level < FAIO__TIMER_LEVELS; level++) {
+    for (slot = 0; slot < FAIO__TIMER_SLOTS; slot++)
+      faio__queue_init(&t->slots[level][slot]);
+
+    t->occupied[level] = 0;
+  }
+
+  t->current = now;
+  t->now = now;
+}
+
+static void faio__timers_insert(struct faio__timers *t,
+                                struct faio_timer *timer)
+{
+  unsigned int level;
+  unsigned int slot;
+  uint64_t expires;
+  uint64_t delta;
+
+  /* Timers that are already due go in the current slot. */
+  expires = timer->deadline;
+  if (expires < t->current)
+    expires = t->current;
+
+  delta = expires - t->current;
+
+  for (level = 0; level < FAIO__TIMER_LEVELS - 1; level++)
+    if (delta >> (FAIO__TIMER_BITS * (level + 1)) == 0)
+      break;
+
+  if (delta >> (FAIO__TIMER_BITS * FAIO__TIMER_LEVELS) != 0)
+    expires = t->current +
+              ((uint64_t) 1 << (FAIO__TIMER_BITS * FAIO__TIMER_LEVELS)) - 1;
+
+  slot = (expires >> (FAIO__TIMER_BITS * level)) & FAIO__TIMER_MASK;
+  faio__queue_append(&t->slots[level][slot], &timer->queue);
+  t->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+/* Returns the first tick that has timers to run or cascade, or UINT64_MAX
+ * if there are no timers.
+ */
+static uint64_t faio__timers_next(struct faio__timers *t)
+{
+  unsigned int level;
+  unsigned int shift;
+  unsigned int slot;
+  unsigned int dist;
+  uint64_t base;
+  uint64_t bits;
+  uint64_t next;
+  uint64_t tick;
+
+  next = UINT64_MAX;
+
+  for (level = 0; level < FAIO__TIMER_LEVELS; level++) {
+    shift = FAIO__TIMER_BITS * level;
+
+    /* The first slot boundary at this level that's not in the past. */
+    base = (t->current + ((uint64_t) 1 << shift) - 1) >> shift;
+
+    while ((bits = t->occupied[level]) != 0) {
+      /* Rotate so that bit 0 is the slot at |base|. */
+      slot = base & FAIO__TIMER_MASK;
+      bits = (bits >> slot) |
+             (bits << ((FAIO__TIMER_SLOTS - slot) & FAIO__TIMER_MASK));
+      dist = faio__timers_ctz(bits);
+      slot = (base + dist) & FAIO__TIMER_MASK;
+
+      if (faio__queue_empty(&t->slots[level][slot])) {
+        t->occupied[level] &= ~((uint64_t) 1 << slot);
+        continue;
+      }
+
+      tick = (base + dist) << shift;
+      if (next > tick)
+        next = tick;
+
+      break;
+    }
+  }
+
+  return next;
+}
+
+static void faio__timers_cascade(struct faio__timers *t,
+                                 unsigned int level,
+                                 unsigned int slot)
+{
+  struct faio__queue *queue;
+  struct faio__queue list;
+
+  faio__queue_move(&t->slots[level][slot], &list);
+  t->occupied[level] &= ~((uint64_t) 1 << slot);
+
+  while (!faio__queue_empty(&list)) {
+    queue = faio__queue_head(&list);
+    faio__queue_remove(queue);
+    faio__timers_insert(t, faio__queue_data(queue, struct faio_timer, queue));
+  }
+}
+
+/* Run the callbacks of all timers that expired at or before t->now.
+ * Returns 1 if any callbacks were invoked, 0 otherwise.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio__timers_run(struct faio_loop *loop, struct faio__timers *t)
+{
+  struct faio_timer *timer;
+  struct faio__queue *queue;
+  struct faio__queue expired;
+  unsigned int level;
+  unsigned int slot;
+  uint64_t tick;
+  int ran;
+
+  ran = 0;
+
+  while ((tick = faio__timers_next(t)) <= t->now) {
+    t->current = tick;
+
+    if ((tick & FAIO__TIMER_MASK) == 0) {
+      for (level = 1; level < FAIO__TIMER_LEVELS; level++) {
+        slot = (tick >> (FAIO__TIMER_BITS * level)) & FAIO__TIMER_MASK;
+        faio__timers_cascade(t, level, slot);
+
+        if (slot != 0)
+          break;
+      }
+    }
+
+    /* Detach the slot and advance the wheel first so that callbacks that
+     * restart their timer don't end up in the list that's being drained.
+     */
+    slot = tick & FAIO__TIMER_MASK;
+    faio__queue_move(&t->slots[0][slot], &expired);
+    t->occupied[0] &= ~((uint64_t) 1 << slot);
+    t->current = tick + 1;
+
+    while (!faio__queue_empty(&expired)) {
+      queue = faio__queue_head(&expired);
+      faio__queue_remove(queue);
+      timer = faio__queue_data(queue, struct faio_timer, queue);
+      timer->cb(loop, timer);
+      ran = 1;
+    }
+  }
+
+  /* Nothing is due between t->current and t->now, skip ahead. */
+  if (t->current < t->now)
+    t->current = t->now;
+
+  return ran;
+}
+
+/* Returns how many nanoseconds the loop can block until either the first
+ * timer or |deadline| expires, or -1 if it can block indefinitely. The
+ * deadline is in nanoseconds too.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int64_t faio__timers_timeout(struct faio__timers *t, uint64_t deadline)
+{
+  uint64_t next;
+
+  next = faio__timers_next(t);
+
+  if (next < UINT64_MAX / 1000000 && next * 1000000 < deadline)
+    deadline = next * 1000000;
+
+  if (deadline == UINT64_MAX)
+    return -1;
+
+  if (deadline <= t->hrnow)
+    return 0;
+
+  if (deadline - t->hrnow > INT64_MAX)
+    return INT64_MAX;
+
+  return deadline - t->hrnow;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__timers_start(struct faio__timers *t,
+                               struct faio_timer *timer,
+                               void (*cb)(struct faio_loop *loop,
+                                          struct faio_timer *timer),
+                               double timeout)
+{
+  /* Restarting is just an unlink and a relink. */
+  if (timer->queue.prev != NULL)
+    faio__queue_remove(&timer->queue);
+
+  if (timeout < 0)
+    timeout = 0;
+
+  /* Round up to the next tick so the timer never fires early. */
+  timer->cb = cb;
+  timer->deadline = t->hrnow + (uint64_t) (timeout * 1e9) + 999999;
+  timer->deadline /= 1000000;
+  faio__timers_insert(t, timer);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__timers_stop(struct faio_timer *timer)
+{
+  /* Zeroed timers have never been started. */
+  if (timer->queue.prev != NULL)
+    faio__queue_remove(&timer->queue);
+}
+
+#endif /* FAIO_TIMER_H_ */
@@ -0,0 +1,1143 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_URING_H_
+#define FAIO_URING_H_
+
+#include "faio-util.h"
+#include "faio-timer.h"
+#include "faio-async.h"
+#include "faio-signal.h"
+#include "faio-batch.h"
+#include "faio-busy.h"
+#include "faio-budget.h"
+#include "faio-priority.h"
+#include "faio-stats.h"
+#include "faio-probes.h"
+#include "faio-watchdog.h"
+#include "faio-slab.h"
+#include "faio-writeq.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <endian.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FAIO_POLLIN   EPOLLIN
+#define FAIO_POLLOUT  EPOLLOUT
+#define FAIO_POLLERR  EPOLLERR
+#define FAIO_POLLHUP  EPOLLHUP
+
+#define FAIO__URING_SQ_ENTRIES  256
+#define FAIO__URING_CQ_ENTRIES  4096
+#define FAIO__URING_BUF_COUNT   1024  /* Must be a power of two. */
+#define FAIO__URING_BUF_SIZE    4096
+#define FAIO__URING_BUF_GROUP   0
+
+/* Tags user_data values that point to a struct faio_req. Handles use
+ * their slot ID shifted left by one, see faio-slab.h. Completions that
+ * nobody cares about, those of IORING_OP_ASYNC_CANCEL, carry the tag
+ * without a pointer.
+ */
+#define FAIO__URING_REQ_TAG     1
+#define FAIO__URING_IGNORE      FAIO__URING_REQ_TAG
+
+enum
+{
+  FAIO__URING_ACCEPT = 1,
+  FAIO__URING_READ,
+  FAIO__URING_WRITE
+};
+
+struct faio_handle
+{
+  struct faio__queue pending_queue; /* Also links the sorted batch. */
+  void (*cb)(struct faio_loop *, struct faio_handle *, unsigned int);
+  unsigned int events;   /* What the user wants to get notified about. */
+  unsigned int revents;  /* What is actually active. */
+  unsigned int priority; /* FAIO_PRIORITY_HIGH, _NORMAL or _LOW. */
+  int fd;
+  uint64_t id;           /* See faio-slab.h. */
+};
+
+struct faio_loop
+{
+  struct faio__queue pending_queue[FAIO__PRIORITIES];
+  struct faio__timers timers;
+  struct faio__asyncs asyncs;
+  struct faio_handle async_handle;
+  struct faio__signals signals;
+  struct faio_handle signal_handle;
+  struct faio__batch batch; /* Caps the CQEs that are reaped per pass. */
+  struct faio__busy busy;
+  struct faio__budget budget;
+  struct faio__watchdog watchdog;
+  struct faio__queue slabs;
+  struct faio__slots slots;
+#if defined(FAIO_STATS)
+  struct faio__stats stats;
+#endif
+  int ring_fd;
+  unsigned int sq_pending; /* Prepared but not yet submitted SQEs. */
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int *sq_khead;
+  unsigned int *sq_ktail;
+  unsigned int *sq_kflags;
+  struct io_uring_sqe *sqes;
+  unsigned int cq_mask;
+  unsigned int *cq_khead;
+  unsigned int *cq_ktail;
+  struct io_uring_cqe *cqes;
+  void *ring;
+  size_t ring_size;
+  size_t sqes_size;
+  struct io_uring_buf_ring *buf_ring; /* Provided buffers for faio_read(). */
+  char *bufs;
+  unsigned short buf_tail;
+};
+
+/* A completion-based operation, see faio_accept(), faio_read() and
+ * faio_write(). The memory must stay valid until the callback has been
+ * invoked with req->active == 0.
+ */
+struct faio_req
+{
+  void (*cb)(struct faio_loop *, struct faio_req *, int);
+  const char *buf;      /* faio_read(): received data, only valid in cb. */
+  unsigned int len;
+  unsigned int nbytes;  /* faio_write(): bytes written so far. */
+  unsigned char active; /* Zero in the final callback. */
+  unsigned char cancelling; /* Don't re-arm or resubmit, see faio_cancel(). */
+  unsigned char op;
+  int fd;
+};
+
+static void faio__update_time(struct faio_loop *loop)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    abort();
+
+  faio__timers_update(&loop->timers, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int faio__uring_enter(struct faio_loop *loop,
+                             unsigned int to_submit,
+                             unsigned int min_complete,
+                             unsigned int flags,
+                             const void *arg,
+                             size_t argsz)
+{
+  return syscall(SYS_io_uring_enter,
+                 loop->ring_fd,
+                 to_submit,
+                 min_complete,
+                 flags,
+                 arg,
+                 argsz);
+}
+
+/* Tell the kernel about the SQEs that were prepared since the last call.
+ * Returns -1 on error; EINTR and EAGAIN/EBUSY are not errors, the SQEs
+ * simply stay pending until the next call.
+ */
+static int faio__uring_submit(struct faio_loop *loop)
+{
+  unsigned int tail;
+  unsigned int head;
+
+  if (loop->sq_pending == 0)
+    return 0;
+
+  if (faio__uring_enter(loop, loop->sq_pending, 0, 0, NULL, 0) == -1)
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -1;
+
+  head = __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE);
+  tail = *loop->sq_ktail;
+  loop->sq_pending = tail - head;
+
+  return 0;
+}
+
+static struct io_uring_sqe *faio__uring_get_sqe(struct faio_loop *loop)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail;
+  unsigned int head;
+
+  tail = *loop->sq_ktail;
+
+  for (;;) {
+    head = __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (tail - head < loop->sq_entries)
+      break;
+
+    /* Ring is full. Flush it and hope the kernel makes room. */
+    if (faio__uring_submit(loop))
+      abort();
+  }
+
+  sqe = loop->sqes + (tail & loop->sq_mask);
+  memset(sqe, 0, sizeof(*sqe));
+
+  return sqe;
+}
+
+/* Make the SQE returned by the last faio__uring_get_sqe() call visible to
+ * the kernel. It's not submitted until the next io_uring_enter() call.
+ */
+static void faio__uring_commit_sqe(struct faio_loop *loop)
+{
+  __atomic_store_n(loop->sq_ktail, *loop->sq_ktail + 1, __ATOMIC_RELEASE);
+  loop->sq_pending += 1;
+}
+
+static void faio__uring_poll_add(struct faio_loop *loop,
+                                 struct faio_handle *handle)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t events;
+
+  /* Always watch for both readability and writability and let the pending
+   * queue sort out the difference, like the epoll backend does. Multishot
+   * poll requests are edge-triggered on all kernels that support them.
+   */
+  events = EPOLLIN | EPOLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  events = (events << 16) | (events >> 16);
+#endif
+
+  sqe = faio__uring_get_sqe(loop);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = handle->fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = events;
+  sqe->user_data = handle->id << 1;
+  faio__uring_commit_sqe(loop);
+}
+
+static void faio__uring_buf_recycle(struct faio_loop *loop, unsigned int bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = loop->buf_ring->bufs + (loop->buf_tail & (FAIO__URING_BUF_COUNT - 1));
+  buf->addr = (uintptr_t) (loop->bufs + bid * FAIO__URING_BUF_SIZE);
+  buf->len = FAIO__URING_BUF_SIZE;
+  buf->bid = bid;
+
+  loop->buf_tail += 1;
+  __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Register a ring of kernel-provided receive buffers. Connections don't
+ * need a read buffer of their own, the kernel picks one when data arrives.
+ */
+static int faio__uring_buf_init(struct faio_loop *loop)
+{
+  struct io_uring_buf_reg reg;
+  unsigned int i;
+  void *ring;
+  char *bufs;
+
+  ring = mmap(NULL,
+              FAIO__URING_BUF_COUNT * sizeof(struct io_uring_buf),
+              PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS,
+              -1,
+              0);
+
+  if (ring == MAP_FAILED)
+    return -1;
+
+  bufs = malloc(FAIO__URING_BUF_COUNT * FAIO__URING_BUF_SIZE);
+
+  if (bufs == NULL)
+    goto err;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) ring;
+  reg.ring_entries = FAIO__URING_BUF_COUNT;
+  reg.bgid = FAIO__URING_BUF_GROUP;
+
+  if (syscall(SYS_io_uring_register,
+              loop->ring_fd,
+              IORING_REGISTER_PBUF_RING,
+              &reg,
+              1))
+  {
+    goto err;
+  }
+
+  loop->buf_ring = ring;
+  loop->bufs = bufs;
+  loop->buf_tail = 0;
+
+  for (i = 0; i < FAIO__URING_BUF_COUNT; i++)
+    faio__uring_buf_recycle(loop, i);
+
+  return 0;
+
+err:
+  munmap(ring, FAIO__URING_BUF_COUNT * sizeof(struct io_uring_buf));
+  free(bufs);
+  return -1;
+}
+
+static void faio__uring_req_submit(struct faio_loop *loop,
+                                   struct faio_req *req)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = faio__uring_get_sqe(loop);
+  sqe->fd = req->fd;
+  sqe->user_data = (uintptr_t) req | FAIO__URING_REQ_TAG;
+
+  switch (req->op) {
+  case FAIO__URING_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    break;
+
+  case FAIO__URING_READ:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = FAIO__URING_BUF_GROUP;
+    break;
+
+  case FAIO__URING_WRITE:
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uintptr_t) (req->buf + req->nbytes);
+    sqe->len = req->len - req->nbytes;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    break;
+  }
+
+  faio__uring_commit_sqe(loop);
+}
+
+/* Returns 1 if the callback was invoked, 0 otherwise. */
+static int faio__uring_complete(struct faio_loop *loop,
+                                struct faio_req *req,
+                                int res,
+                                unsigned int flags)
+{
+  unsigned int bid;
+
+  if (req->op == FAIO__URING_WRITE) {
+    if (res > 0) {
+      req->nbytes += res;
+
+      if (req->nbytes < req->len && !req->cancelling) {
+        faio__uring_req_submit(loop, req); /* Short write, send the rest. */
+        return 0;
+      }
+
+      res = req->nbytes < req->len ? -ECANCELED : (int) req->nbytes;
+    }
+
+    req->active = 0;
+    req->cb(loop, req, res);
+    return 1;
+  }
+
+  /* Multishot requests end when the kernel runs out of buffers or the
+   * completion queue overflows. Re-arm them, the caller doesn't care.
+   * Unless they're being cancelled: a re-armed request would be queued
+   * behind the cancel and miss it, and never complete.
+   */
+  if ((flags & IORING_CQE_F_MORE) == 0) {
+    if (req->cancelling)
+      req->active = 0;
+    else if (res == -ENOBUFS) {
+      faio__uring_req_submit(loop, req);
+      return 0;
+    }
+    else if (res > 0 || (res == 0 && req->op == FAIO__URING_ACCEPT))
+      faio__uring_req_submit(loop, req);
+    else
+      req->active = 0;
+  }
+
+  if (req->op != FAIO__URING_READ || (flags & IORING_CQE_F_BUFFER) == 0) {
+    req->cb(loop, req, res);
+    return 1;
+  }
+
+  bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  req->buf = loop->bufs + bid * FAIO__URING_BUF_SIZE;
+  req->len = res;
+  req->cb(loop, req, res);
+
+  /* The callback may have released |req|, don't touch it. */
+  faio__uring_buf_recycle(loop, bid);
+
+  return 1;
+}
+
+/* Returns the number of unprocessed CQEs. */
+static unsigned int faio__uring_cq_ready(struct faio_loop *loop)
+{
+  return __atomic_load_n(loop->cq_ktail, __ATOMIC_ACQUIRE) - *loop->cq_khead;
+}
+
+/* Poll the completion queue until there are completions or the busy poll
+ * budget runs out. Returns 1 if there are completions, 0 otherwise.
+ */
+static int faio__uring_spin(struct faio_loop *loop, int64_t ns)
+{
+  uint64_t stop;
+
+  stop = faio__busy_deadline(&loop->busy, ns);
+
+  if (stop == 0)
+    return 0;
+
+  do {
+    /* Submits pending SQEs and runs deferred task work. */
+    if (faio__uring_enter(loop,
+                          loop->sq_pending,
+                          0,
+                          IORING_ENTER_GETEVENTS,
+                          NULL,
+                          0) == -1)
+    {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        abort();
+    }
+
+    loop->sq_pending = *loop->sq_ktail -
+                       __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE);
+
+    FAIO__STATS(faio__stats_poll(&loop->stats,
+                                 faio__uring_cq_ready(loop),
+                                 loop->batch.size));
+
+    if (faio__uring_cq_ready(loop)) {
+      FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
+      loop->busy.spin_wakeups++;
+      return 1;
+    }
+
+    if (faio__asyncs_pending(&loop->asyncs)) {
+      loop->busy.spin_wakeups++;
+      return 0;
+    }
+  }
+  while (faio__busy_hrtime() < stop);
+
+  return 0;
+}
+
+/* Checks that the kernel knows every opcode we use. Multishot poll (Linux
+ * 5.13) doesn't have an opcode of its own but came with
+ * IORING_FEAT_RSRC_TAGS. Provided buffer rings, multishot accept (5.19)
+ * and multishot recv (6.0) don't either, IORING_OP_SEND_ZC stands in for
+ * them. Fails with ENOSYS if something's missing.
+ */
+static int faio__uring_probe(int ring_fd, unsigned int features)
+{
+  static const unsigned char ops[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SEND,
+    IORING_OP_SEND_ZC,
+  };
+  struct io_uring_probe *probe;
+  unsigned int i;
+  size_t size;
+  int r;
+
+  if ((features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (features & IORING_FEAT_NODROP) == 0 ||
+      (features & IORING_FEAT_EXT_ARG) == 0 ||
+      (features & IORING_FEAT_RSRC_TAGS) == 0)
+  {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+  probe = calloc(1, size);
+
+  if (probe == NULL)
+    return -1;
+
+  /* IORING_REGISTER_PROBE itself is from Linux 5.6. */
+  r = syscall(SYS_io_uring_register,
+              ring_fd,
+              IORING_REGISTER_PROBE,
+              probe,
+              256);
+
+  if (r == -1) {
+    free(probe);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (ops[i] > probe->last_op ||
+        ops[i] >= probe->ops_len ||
+        (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+    {
+      free(probe);
+      errno = ENOSYS;
+      return -1;
+    }
+  }
+
+  free(probe);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_init(struct faio_loop *loop)
+{
+  struct io_uring_params params;
+  unsigned int *sq_array;
+  unsigned int i;
+  size_t sq_size;
+  size_t cq_size;
+  char *sq_ring;
+  char *cq_ring;
+  int saved_errno;
+  int ring_fd;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = FAIO__URING_CQ_ENTRIES;
+
+  ring_fd = syscall(SYS_io_uring_setup, FAIO__URING_SQ_ENTRIES, &params);
+
+  /* IORING_SETUP_COOP_TASKRUN is only supported since Linux 5.19. */
+  if (ring_fd == -1 && errno == EINVAL) {
+    params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+    ring_fd = syscall(SYS_io_uring_setup, FAIO__URING_SQ_ENTRIES, &params);
+  }
+
+  if (ring_fd == -1)
+    return -1;
+
+  if (faio__uring_probe(ring_fd, params.features))
+    goto err;
+
+  /* The SQ and CQ rings live in the same mapping with
+   * IORING_FEAT_SINGLE_MMAP; map whichever is bigger.
+   */
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(*sq_array);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(*loop->cqes);
+  loop->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  loop->sqes_size = params.sq_entries * sizeof(*loop->sqes);
+
+  loop->ring = mmap(NULL,
+                    loop->ring_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd,
+                    IORING_OFF_SQ_RING);
+
+  if (loop->ring == MAP_FAILED)
+    goto err;
+
+  loop->sqes = mmap(NULL,
+                    loop->sqes_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd,
+                    IORING_OFF_SQES);
+
+  if (loop->sqes == MAP_FAILED) {
+    munmap(loop->ring, loop->ring_size);
+    goto err;
+  }
+
+  sq_ring = loop->ring;
+  cq_ring = loop->ring;
+
+  loop->sq_khead = (unsigned int *) (sq_ring + params.sq_off.head);
+  loop->sq_ktail = (unsigned int *) (sq_ring + params.sq_off.tail);
+  loop->sq_kflags = (unsigned int *) (sq_ring + params.sq_off.flags);
+  loop->sq_mask = *(unsigned int *) (sq_ring + params.sq_off.ring_mask);
+  loop->sq_entries = params.sq_entries;
+  loop->sq_pending = 0;
+
+  /* Map SQ slots 1:1 to SQEs, that way we never have to touch it again. */
+  sq_array = (unsigned int *) (sq_ring + params.sq_off.array);
+  for (i = 0; i < params.sq_entries; i++)
+    sq_array[i] = i;
+
+  loop->cq_khead = (unsigned int *) (cq_ring + params.cq_off.head);
+  loop->cq_ktail = (unsigned int *) (cq_ring + params.cq_off.tail);
+  loop->cq_mask = *(unsigned int *) (cq_ring + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+  loop->buf_ring = NULL;
+  loop->bufs = NULL;
+  loop->buf_tail = 0;
+
+  /* Can't fail, the CQEs live in the ring. */
+  faio__batch_init(&loop->batch, 0);
+
+  loop->ring_fd = ring_fd;
+  faio__priority_init(loop->pending_queue);
+  faio__update_time(loop);
+  faio__timers_init(&loop->timers, loop->timers.now);
+  faio__asyncs_init(&loop->asyncs);
+  faio__signals_init(&loop->signals);
+  faio__busy_init(&loop->busy);
+  faio__budget_init(&loop->budget);
+  faio__watchdog_init(&loop->watchdog);
+  faio__queue_init(&loop->slabs);
+  faio__slots_init(&loop->slots);
+  FAIO__STATS(faio__stats_init(&loop->stats));
+
+  return 0;
+
+err:
+  saved_errno = errno;
+  close(ring_fd);
+  errno = saved_errno;
+  return -1;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_fini(struct faio_loop *loop)
+{
+  faio__asyncs_fini(&loop->asyncs);
+  faio__signals_fini(&loop->signals);
+  faio__batch_fini(&loop->batch);
+  faio__slabs_fini(&loop->slabs);
+  faio__slots_fini(&loop->slots);
+
+  if (loop->buf_ring != NULL) {
+    munmap(loop->buf_ring,
+           FAIO__URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(loop->bufs);
+    loop->buf_ring = NULL;
+    loop->bufs = NULL;
+  }
+
+  munmap(loop->sqes, loop->sqes_size);
+  munmap(loop->ring, loop->ring_size);
+  close(loop->ring_fd);
+  loop->ring_fd = -1;
+}
+
+/* Same as faio__epoll_dispatch(). */
+static int faio__uring_dispatch(struct faio_loop *loop,
+                                struct faio__queue *ready,
+                                int replay)
+{
+  struct faio_handle *handle;
+  struct faio__queue *queue;
+  unsigned int revents;
+  unsigned int prio;
+  int dispatched;
+
+  dispatched = 0;
+
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++) {
+    while (!faio__queue_empty(&ready[prio])) {
+      if (faio__budget_spent(&loop->budget))
+        break;
+
+      queue = faio__queue_head(&ready[prio]);
+      handle = faio__queue_data(queue, struct faio_handle, pending_queue);
+      faio__queue_remove(queue);
+
+      if (replay)
+        FAIO__STATS(loop->stats.counters.pending_replays++);
+
+      revents = handle->revents & handle->events;
+      if (revents == 0)
+        continue;
+
+      FAIO__STATS(loop->stats.counters.callbacks++);
+
+      if (replay) {
+        FAIO__PROBE3(replay, handle->fd, revents, handle);
+      } else {
+        FAIO__PROBE3(dispatch, handle->fd, revents, handle);
+      }
+
+      faio__watchdog_begin(&loop->watchdog, handle->fd, handle->cb);
+      handle->cb(loop, handle, revents);
+      FAIO__PROBE(dispatch__done);
+      faio__watchdog_end(loop, &loop->watchdog);
+      faio__budget_charge(&loop->budget);
+      dispatched = 1;
+    }
+  }
+
+  if (replay) {
+    faio__priority_prepend(ready, loop->pending_queue);
+    return dispatched;
+  }
+
+#if defined(FAIO_STATS)
+  for (prio = 0; prio < FAIO__PRIORITIES; prio++)
+    for (queue = faio__queue_head(&ready[prio]);
+         queue != &ready[prio];
+         queue = queue->next)
+    {
+      loop->stats.counters.budget_carryovers++;
+    }
+#endif
+
+  faio__priority_concat(ready, loop->pending_queue);
+
+  return dispatched;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_poll_ns(struct faio_loop *loop, int64_t timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct faio__queue ready[FAIO__PRIORITIES];
+  struct io_uring_cqe *cqe;
+  struct faio_handle *handle;
+  struct faio_req *req;
+  unsigned int dispatched;
+  unsigned int revents;
+  unsigned int flags;
+  unsigned int maxevents;
+  unsigned int nreaped;
+  unsigned int head;
+  unsigned int tail;
+  uint64_t user_data;
+  uint64_t deadline;
+  int64_t ns;
+  int res;
+  int n;
+
+  faio__budget_begin(&loop->budget);
+  FAIO__STATS(faio__stats_dispatch_begin(&loop->stats));
+
+  /* Handles that callbacks put back on the pending queue wait for the
+   * next call, see the epoll backend.
+   */
+  faio__priority_move(loop->pending_queue, ready);
+  dispatched = faio__uring_dispatch(loop, ready, 1);
+
+  faio__update_time(loop);
+  FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
+
+  if (faio__timers_run(loop, &loop->timers))
+    dispatched = 1;
+
+  if (dispatched)
+    timeout = 0;
+
+  if (timeout < 0)
+    deadline = UINT64_MAX;
+  else
+    deadline = loop->timers.hrnow + timeout;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uintptr_t) &ts;
+
+  for (;;) {
+    ns = faio__timers_timeout(&loop->timers, deadline);
+
+    if (faio__uring_spin(loop, ns) == 0) {
+      if (faio__asyncs_before_wait(&loop->asyncs))
+        ns = 0;
+
+      ts.tv_sec = ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+
+      FAIO__STATS(faio__stats_wait_begin(&loop->stats));
+      FAIO__PROBE1(poll__begin, ns);
+
+      /* Submit pending registration changes and wait in one syscall. */
+      if (ns == -1)
+        n = faio__uring_enter(loop,
+                              loop->sq_pending,
+                              1,
+                              IORING_ENTER_GETEVENTS,
+                              NULL,
+                              0);
+      else
+        n = faio__uring_enter(loop,
+                              loop->sq_pending,
+                              ns == 0 ? 0 : 1,
+                              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                              &arg,
+                              sizeof(arg));
+
+      if (n == -1)
+        if (errno != EINTR && errno != ETIME)
+          if (errno != EAGAIN && errno != EBUSY)
+            abort();
+
+      FAIO__PROBE1(poll__end, faio__uring_cq_ready(loop));
+      faio__asyncs_after_wait(&loop->asyncs);
+
+      loop->sq_pending = *loop->sq_ktail -
+                         __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE);
+
+      FAIO__STATS(faio__stats_wait_end(&loop->stats,
+                                       faio__uring_cq_ready(loop),
+                                       loop->batch.size));
+
+      if (ns != 0 && faio__uring_cq_ready(loop))
+        loop->busy.block_wakeups++;
+    }
+
+    head = *loop->cq_khead;
+    tail = __atomic_load_n(loop->cq_ktail, __ATOMIC_ACQUIRE);
+
+    maxevents = loop->batch.size;
+
+    if (tail - head > maxevents)
+      tail = head + maxevents;
+
+    nreaped = tail - head;
+
+    /* Consume CQEs one by one. Requests are completed right away, handles
+     * are sorted by priority and dispatched afterwards.
+     */
+    faio__priority_init(ready);
+
+    while (head != tail) {
+      cqe = loop->cqes + (head & loop->cq_mask);
+      user_data = cqe->user_data;
+
+      /* Over budget. Request completions can't go on the pending queue,
+       * leave them and everything after them in the ring for the next
+       * call.
+       */
+      if (user_data & FAIO__URING_REQ_TAG)
+        if (faio__budget_spent(&loop->budget))
+          break;
+
+      flags = cqe->flags;
+      res = cqe->res;
+      __atomic_store_n(loop->cq_khead, ++head, __ATOMIC_RELEASE);
+
+      if (user_data & FAIO__URING_REQ_TAG) {
+        user_data &= ~(uint64_t) FAIO__URING_REQ_TAG;
+        req = (struct faio_req *) (uintptr_t) user_data;
+
+        if (req == NULL)
+          continue;
+
+        if (faio__uring_complete(loop, req, res, flags)) {
+          FAIO__STATS(loop->stats.counters.callbacks++);
+          faio__budget_charge(&loop->budget);
+          dispatched = 1;
+        }
+
+        continue;
+      }
+
+      /* The handle has been deleted since, possibly freed. That includes
+       * completions that were on the kernel's overflow list when it was.
+       * A cancelled poll request reports -ECANCELED.
+       */
+      handle = faio__slots_get(&loop->slots, user_data >> 1);
+
+      if (handle == NULL || res == -ECANCELED)
+        continue;
+
+      if (res < 0)
+        revents = EPOLLERR;
+      else {
+        revents = res;
+
+        /* The kernel terminated the multishot request, e.g. because the
+         * completion queue overflowed. Re-arm it.
+         */
+        if ((flags & IORING_CQE_F_MORE) == 0)
+          faio__uring_poll_add(loop, handle);
+      }
+
+      /* Unlike epoll, the kernel reports what triggered the wakeup, not
+       * the full readiness state. A POLLIN-only completion doesn't mean the
+       * fd stopped being writable, so accumulate.
+       */
+      handle->revents |= revents;
+
+      if ((handle->revents & handle->events) == 0)
+        continue;
+
+      /* Still pending from an earlier call, or already in |ready|. */
+      if (!faio__queue_empty(&handle->pending_queue))
+        continue;
+
+      faio__queue_append(&ready[handle->priority], &handle->pending_queue);
+    }
+
+    if (faio__uring_dispatch(loop, ready, 0))
+      dispatched = 1;
+
+    nreaped -= tail - head;
+    FAIO__STATS(loop->stats.counters.events += nreaped);
+    faio__batch_update(&loop->batch, nreaped);
+
+    if (faio__asyncs_run(loop, &loop->asyncs))
+      dispatched = 1;
+
+    faio__update_time(loop);
+    FAIO__STATS(faio__stats_dispatch_end(&loop->stats, loop->timers.hrnow));
+
+    if (faio__timers_run(loop, &loop->timers))
+      dispatched = 1;
+
+    /* Whatever is left in the ring waits for the next call. */
+    if (faio__budget_spent(&loop->budget))
+      return;
+
+    /* The kernel had more completions than fit in the completion queue or
+     * the batch. Flush them but don't block this time.
+     */
+    if (nreaped == maxevents || *loop->sq_kflags & IORING_SQ_CQ_OVERFLOW) {
+      deadline = loop->timers.hrnow;
+      continue;
+    }
+
+    if (dispatched)
+      return;
+
+    /* We didn't invoke any callbacks, just updated some watchers or got
+     * interrupted. From the perspective of the caller nothing happened
+     * so poll again, unless the timeout expired.
+     */
+    if (loop->timers.hrnow >= deadline)
+      return;
+  }
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_add(struct faio_loop *loop,
+                    struct faio_handle *handle,
+                    void (*cb)(struct faio_loop *loop,
+                               struct faio_handle *handle,
+                               unsigned int revents),
+                    int fd,
+                    unsigned int events)
+{
+  events &= EPOLLIN | EPOLLOUT;
+  events |= EPOLLERR | EPOLLHUP;
+
+  if (faio__slots_alloc(&loop->slots, handle, &handle->id))
+    return -1;
+
+  faio__queue_init(&handle->pending_queue);
+  handle->cb = cb;
+  handle->fd = fd;
+  handle->events = events;
+  handle->revents = 0;
+  handle->priority = FAIO_PRIORITY_NORMAL;
+  FAIO__PROBE3(add, fd, events, handle);
+
+  /* Submitted together with the next wait in faio_poll(). Errors like
+   * EBADF are reported as FAIO_POLLERR events.
+   */
+  faio__uring_poll_add(loop, handle);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_mod(struct faio_loop *loop,
+                    struct faio_handle *handle,
+                    unsigned int events)
+{
+  events &= EPOLLIN | EPOLLOUT;
+  events |= EPOLLERR | EPOLLHUP;
+  handle->events = events;
+  FAIO__PROBE3(mod, handle->fd, events, handle);
+
+  if (0 == (events & handle->revents))
+    return 0;
+
+  if (faio__queue_empty(&handle->pending_queue))
+    faio__queue_append(&loop->pending_queue[handle->priority],
+                       &handle->pending_queue);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_del(struct faio_loop *loop, struct faio_handle *handle)
+{
+  struct io_uring_sqe *sqe;
+
+  FAIO__PROBE2(del, handle->fd, handle);
+  handle->events = 0;
+
+  if (!faio__queue_empty(&handle->pending_queue))
+    faio__queue_remove(&handle->pending_queue);
+
+  sqe = faio__uring_get_sqe(loop);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = handle->id << 1;
+  sqe->user_data = FAIO__URING_IGNORE;
+  faio__uring_commit_sqe(loop);
+
+  /* The caller is free to release the handle once we return. Completions
+   * for it that are still in the ring or on the kernel's overflow list no
+   * longer match its slot and are dropped. Submit the cancellation now,
+   * the poll request keeps a reference to the file until it's gone.
+   * Unlike IORING_OP_POLL_REMOVE, it also works when a wakeup is in
+   * flight.
+   */
+  if (faio__slots_get(&loop->slots, handle->id) == handle)
+    faio__slots_free(&loop->slots, handle->id);
+
+  if (faio__uring_submit(loop))
+    return -1;
+
+  return 0;
+}
+
+static int faio__uring_req_start(struct faio_loop *loop,
+                                 struct faio_req *req,
+                                 void (*cb)(struct faio_loop *loop,
+                                            struct faio_req *req,
+                                            int result),
+                                 int fd,
+                                 unsigned int op)
+{
+  if (req->active) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  req->cb = cb;
+  req->fd = fd;
+  req->op = op;
+  req->active = 1;
+  req->cancelling = 0;
+  faio__uring_req_submit(loop, req);
+
+  return 0;
+}
+
+/* Accept connections on |fd| until cancelled. The callback is invoked once
+ * for every new connection with the (non-blocking) file descriptor as the
+ * result, or with a negative errno value on error.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_accept(struct faio_loop *loop,
+                       struct faio_req *req,
+                       void (*cb)(struct faio_loop *loop,
+                                  struct faio_req *req,
+                                  int result),
+                       int fd)
+{
+  return faio__uring_req_start(loop, req, cb, fd, FAIO__URING_ACCEPT);
+}
+
+/* Read from |fd| until EOF, error or cancellation. The callback is invoked
+ * with the number of bytes read and req->buf pointing to the data. The
+ * buffer is owned by the loop and reused after the callback returns.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_read(struct faio_loop *loop,
+                     struct faio_req *req,
+                     void (*cb)(struct faio_loop *loop,
+                                struct faio_req *req,
+                                int result),
+                     int fd)
+{
+  if (loop->buf_ring == NULL)
+    if (faio__uring_buf_init(loop))
+      return -1;
+
+  return faio__uring_req_start(loop, req, cb, fd, FAIO__URING_READ);
+}
+
+/* Write |len| bytes to |fd|. Short writes are retried; the callback is
+ * invoked once with the number of bytes written or a negative errno value.
+ * Writes issued in the same loop iteration are submitted together.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_write(struct faio_loop *loop,
+                      struct faio_req *req,
+                      void (*cb)(struct faio_loop *loop,
+                                 struct faio_req *req,
+                                 int result),
+                      int fd,
+                      const void *buf,
+                      unsigned int len)
+{
+  req->buf = buf;
+  req->len = len;
+  req->nbytes = 0;
+
+  return faio__uring_req_start(loop, req, cb, fd, FAIO__URING_WRITE);
+}
+
+/* Cancel an active request. Its callback is invoked one final time, most
+ * likely with -ECANCELED.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_cancel(struct faio_loop *loop, struct faio_req *req)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!req->active || req->cancelling)
+    return 0;
+
+  req->cancelling = 1;
+  sqe = faio__uring_get_sqe(loop);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uintptr_t) req | FAIO__URING_REQ_TAG;
+  sqe->user_data = FAIO__URING_IGNORE;
+  faio__uring_commit_sqe(loop);
+
+  return 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_busy_poll(struct faio_loop *loop, unsigned int usecs)
+{
+  loop->busy.usecs = usecs;
+  return 0;
+}
+
+/* Poll requests keep the file open, they have to be cancelled first. */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_close(struct faio_loop *loop, struct faio_handle *handle)
+{
+  faio_del(loop, handle);
+  return close(handle->fd);
+}
+
+#endif /* FAIO_URING_H_ */
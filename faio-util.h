@@ -68,6 +68,50 @@ static void faio__queue_append(struct faio__queue *q, struct faio__queue *n)
   q->prev = n;
 }
 
+/* Moves all elements of |h| to |n|, leaving |h| empty. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__queue_move(struct faio__queue *h, struct faio__queue *n)
+{
+  if (faio__queue_empty(h)) {
+    faio__queue_init(n);
+    return;
+  }
+
+  n->next = h->next;
+  n->prev = h->prev;
+  n->next->prev = n;
+  n->prev->next = n;
+  faio__queue_init(h);
+}
+
+/* Moves all elements of |h| to the back of |n|, leaving |h| empty. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__queue_concat(struct faio__queue *h, struct faio__queue *n)
+{
+  if (faio__queue_empty(h))
+    return;
+
+  h->next->prev = n->prev;
+  n->prev->next = h->next;
+  n->prev = h->prev;
+  h->prev->next = n;
+  faio__queue_init(h);
+}
+
+/* Moves all elements of |h| to the front of |n|, leaving |h| empty. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__queue_prepend(struct faio__queue *h, struct faio__queue *n)
+{
+  if (faio__queue_empty(h))
+    return;
+
+  h->prev->next = n->next;
+  n->next->prev = h->prev;
+  n->next = h->next;
+  h->next->prev = n;
+  faio__queue_init(h);
+}
+
 FAIO_ATTRIBUTE_UNUSED
 static void faio__queue_remove(struct faio__queue *n)
 {
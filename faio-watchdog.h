@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAIO_WATCHDOG_H_
+#define FAIO_WATCHDOG_H_
+
+#include "faio-busy.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slow callback detection. Times handle callbacks, or one in |sample| of
+ * them, and reports the ones that take longer than |threshold| to the
+ * hook. Costs a single branch per dispatch when it's off.
+ */
+struct faio__watchdog
+{
+  void (*hook)(struct faio_loop *, const struct faio_slow_callback *);
+  struct faio_slow_callback slow; /* Callback that is being timed. */
+  uint64_t threshold;             /* In nanoseconds. */
+  uint64_t start;                 /* Zero if not timing. */
+  unsigned int sample;
+  unsigned int countdown;
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__watchdog_init(struct faio__watchdog *w)
+{
+  w->hook = NULL;
+  w->threshold = 0;
+  w->start = 0;
+  w->sample = 1;
+  w->countdown = 1;
+}
+
+/* Call right before invoking a handle callback. The handle may be freed
+ * by the callback so the fd and callback are copied now.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio__watchdog_begin(struct faio__watchdog *w,
+                                 int fd,
+                                 void (*cb)(struct faio_loop *,
+                                            struct faio_handle *,
+                                            unsigned int))
+{
+  if (w->hook == NULL)
+    return;
+
+  if (--w->countdown != 0)
+    return;
+
+  w->countdown = w->sample;
+  w->slow.fd = fd;
+  w->slow.cb = cb;
+  w->start = faio__busy_hrtime();
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio__watchdog_end(struct faio_loop *loop,
+                               struct faio__watchdog *w)
+{
+  uint64_t duration;
+
+  if (w->start == 0)
+    return;
+
+  duration = faio__busy_hrtime() - w->start;
+  w->start = 0;
+
+  if (duration < w->threshold)
+    return;
+
+  w->slow.duration_ns = duration;
+  w->hook(loop, &w->slow);
+}
+
+#endif /* FAIO_WATCHDOG_H_ */
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2012, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef FAIO_WRITEQ_H_
+#define FAIO_WRITEQ_H_
+
+#include "faio-util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
+/* Write queues gather the buffers that are queued on a handle into one
+ * writev() per flush, or sendmsg() with MSG_MORE when there are more
+ * buffers than fit in one call. Corking holds back the flush in user
+ * space until the caller says it's done, so a response that's queued
+ * piecemeal still goes out in one system call. When part of a response
+ * has to go out before the rest is known, faio_writeq_flush_more() sets
+ * MSG_MORE on the last call too and the kernel holds back the partial
+ * packet until the next write.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define FAIO__WRITEQ_IOVS IOV_MAX
+#else
+#define FAIO__WRITEQ_IOVS 1024
+#endif
+
+/* Zero-copy sends with MSG_ZEROCOPY pin the pages instead of copying them
+ * into the socket buffer. The kernel numbers each such send and reports
+ * on the socket's error queue when it's done with the pages; until then
+ * the buffers sit on the queue's |zc_bufs| list. Pinning and the extra
+ * notification cost more than copying a small buffer, hence the size
+ * threshold.
+ */
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define FAIO__WRITEQ_ZEROCOPY 1
+#endif
+
+struct faio_wbuf
+{
+  struct faio__queue queue;
+  void (*cb)(struct faio_loop *, struct faio_wbuf *, int);
+  const void *base;
+  size_t len;
+  size_t written;
+  int status;   /* 0 or a negated errno, passed to |cb|. */
+  uint32_t zc_seq;  /* Last zero-copy send that included this buffer. */
+  unsigned int zc:1;
+};
+
+struct faio_writeq
+{
+  struct faio__queue bufs;
+  struct faio__queue zc_bufs; /* Written, waiting for the kernel. */
+  struct faio_handle *handle;
+  size_t zc_threshold;
+  uint32_t zc_next; /* Number of the next zero-copy send. */
+  unsigned int corked:1;
+  unsigned int polling:1;   /* We turned on FAIO_POLLOUT. */
+  unsigned int nosock:1;    /* Not a socket, sendmsg() won't work. */
+  unsigned int zerocopy:1;
+};
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_init(struct faio_writeq *wq,
+                             struct faio_handle *handle)
+{
+  faio__queue_init(&wq->bufs);
+  faio__queue_init(&wq->zc_bufs);
+  wq->handle = handle;
+  wq->zc_threshold = 0;
+  wq->zc_next = 0;
+  wq->corked = 0;
+  wq->polling = 0;
+  wq->nosock = 0;
+  wq->zerocopy = 0;
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_push(struct faio_writeq *wq,
+                             struct faio_wbuf *buf,
+                             const void *base,
+                             size_t len,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_wbuf *buf,
+                                        int status))
+{
+  buf->cb = cb;
+  buf->base = base;
+  buf->len = len;
+  buf->written = 0;
+  buf->status = 0;
+  buf->zc = 0;
+  faio__queue_append(&wq->bufs, &buf->queue);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_empty(const struct faio_writeq *wq)
+{
+  return faio__queue_empty(&wq->bufs) && faio__queue_empty(&wq->zc_bufs);
+}
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_cork(struct faio_writeq *wq)
+{
+  wq->corked = 1;
+}
+
+/* Moves the remaining buffers to |done| with |status|, including the ones
+ * that are waiting for a zero-copy notification.
+ */
+static void faio__writeq_fail(struct faio_writeq *wq,
+                              struct faio__queue *done,
+                              int status)
+{
+  struct faio_wbuf *buf;
+  struct faio__queue *queue;
+
+  while (!faio__queue_empty(&wq->zc_bufs)) {
+    queue = faio__queue_head(&wq->zc_bufs);
+    faio__queue_remove(queue);
+    faio__queue_append(done, queue);
+    buf = faio__queue_data(queue, struct faio_wbuf, queue);
+    buf->status = status;
+  }
+
+  while (!faio__queue_empty(&wq->bufs)) {
+    queue = faio__queue_head(&wq->bufs);
+    faio__queue_remove(queue);
+    faio__queue_append(done, queue);
+    buf = faio__queue_data(queue, struct faio_wbuf, queue);
+    buf->status = status;
+  }
+}
+
+/* Writes as much as the kernel takes. Buffers that have been written in
+ * full are moved to |done|. Returns 0 if the queue is empty, 1 if the
+ * kernel's buffer is full and -1 on error. With |more|, the last batch is
+ * sent with MSG_MORE as well.
+ */
+static int faio__writeq_write(struct faio_writeq *wq,
+                              int fd,
+                              int more,
+                              struct faio__queue *done)
+{
+  struct iovec iov[FAIO__WRITEQ_IOVS];
+  struct faio_wbuf *buf;
+  struct faio__queue *queue;
+  struct msghdr msg;
+  size_t total;
+  size_t avail;
+  uint32_t seq;
+  ssize_t n;
+  int flags;
+  int niov;
+  int next;
+  int full;
+  int zc;
+
+  for (;;) {
+    niov = 0;
+    total = 0;
+    queue = faio__queue_head(&wq->bufs);
+
+    while (queue != &wq->bufs && niov < FAIO__WRITEQ_IOVS) {
+      buf = faio__queue_data(queue, struct faio_wbuf, queue);
+      iov[niov].iov_base = (char *) buf->base + buf->written;
+      iov[niov].iov_len = buf->len - buf->written;
+      total += iov[niov].iov_len;
+      niov++;
+      queue = queue->next;
+    }
+
+    if (niov == 0)
+      return 0;
+
+    /* There's another batch after this one. */
+    next = queue != &wq->bufs;
+    flags = 0;
+    zc = 0;
+
+#if defined(MSG_MORE)
+    if (next || more)
+      flags |= MSG_MORE;
+#else
+    (void) next;
+    (void) more;
+#endif
+
+#if defined(FAIO__WRITEQ_ZEROCOPY)
+    if (wq->zerocopy && total >= wq->zc_threshold) {
+      flags |= MSG_ZEROCOPY;
+      zc = 1;
+    }
+#endif
+
+    if (flags != 0 && wq->nosock == 0) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = niov;
+      n = sendmsg(fd, &msg, flags);
+
+      if (n == -1 && errno == ENOTSOCK) {
+        wq->nosock = 1;
+        continue;
+      }
+
+      /* Out of memory for pinning pages, copy this batch instead. */
+      if (n == -1 && errno == ENOBUFS && zc) {
+        zc = 0;
+        n = writev(fd, iov, niov);
+      }
+    }
+    else
+      n = writev(fd, iov, niov);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+
+      return -1;
+    }
+
+    /* A short write means the socket buffer is full. Don't bother trying
+     * again, it would only return EAGAIN.
+     */
+    full = (size_t) n < total;
+
+    /* Every successful zero-copy send gets the next number, short or not. */
+    seq = zc ? wq->zc_next++ : 0;
+
+    /* Zero-length buffers complete as soon as they reach the head. */
+    while (!faio__queue_empty(&wq->bufs)) {
+      queue = faio__queue_head(&wq->bufs);
+      buf = faio__queue_data(queue, struct faio_wbuf, queue);
+      avail = buf->len - buf->written;
+
+      if (zc && avail > 0 && n > 0) {
+        buf->zc_seq = seq;
+        buf->zc = 1;
+      }
+
+      if (avail > (size_t) n) {
+        buf->written += n;
+        break;
+      }
+
+      n -= avail;
+      buf->written = buf->len;
+      faio__queue_remove(queue);
+      faio__queue_append(buf->zc ? &wq->zc_bufs : done, queue);
+    }
+
+    if (full)
+      return 1;
+  }
+}
+
+#if defined(FAIO__WRITEQ_ZEROCOPY)
+
+/* Moves the buffers that the kernel is done with to |done|. TCP reports
+ * completions in order, |hi| covers everything up to and including it.
+ */
+static void faio__writeq_release(struct faio_writeq *wq,
+                                 uint32_t hi,
+                                 struct faio__queue *done)
+{
+  struct faio_wbuf *buf;
+  struct faio__queue *queue;
+
+  while (!faio__queue_empty(&wq->zc_bufs)) {
+    queue = faio__queue_head(&wq->zc_bufs);
+    buf = faio__queue_data(queue, struct faio_wbuf, queue);
+
+    if ((int32_t) (buf->zc_seq - hi) > 0)
+      break;
+
+    faio__queue_remove(queue);
+    faio__queue_append(done, queue);
+  }
+}
+
+/* Drains the error queue of |fd|. Returns 1 if it held zero-copy
+ * notifications, 0 otherwise.
+ */
+static int faio__writeq_notifications(struct faio_writeq *wq,
+                                      int fd,
+                                      struct faio__queue *done)
+{
+  struct sock_extended_err *serr;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  char control[256];
+  int found;
+
+  found = 0;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+      {
+        continue;
+      }
+
+      serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      /* The kernel copied after all, loopback always does. Stop paying
+       * for the notifications.
+       */
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        wq->zerocopy = 0;
+
+      faio__writeq_release(wq, serr->ee_data, done);
+      found = 1;
+    }
+  }
+
+  return found;
+}
+
+#endif /* defined(FAIO__WRITEQ_ZEROCOPY) */
+
+/* Invokes the callbacks of the buffers in |done|. Callbacks may free the
+ * write queue, don't touch it afterwards.
+ */
+static void faio__writeq_complete(struct faio_loop *loop,
+                                  struct faio__queue *done)
+{
+  struct faio_wbuf *buf;
+  struct faio__queue *queue;
+
+  while (!faio__queue_empty(done)) {
+    queue = faio__queue_head(done);
+    faio__queue_remove(queue);
+    buf = faio__queue_data(queue, struct faio_wbuf, queue);
+
+    if (buf->cb != NULL)
+      buf->cb(loop, buf, buf->status);
+  }
+}
+
+#endif /* FAIO_WRITEQ_H_ */
@@ -17,6 +17,9 @@
 #ifndef FAIO_H_
 #define FAIO_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #if defined(__GNUC__)
 #define FAIO_ATTRIBUTE_UNUSED __attribute__((unused))
 #else
@@ -25,16 +28,59 @@
 
 struct faio_loop;
 struct faio_handle;
+struct faio_timer;
+struct faio_async;
+struct faio_async_node;
+struct faio_signal;
+struct faio_slab;
+struct faio_wbuf;
+struct faio_writeq;
+struct faio_listener;
+
+/* See faio_set_watchdog(). The handle itself may be gone by the time the
+ * hook runs, hence the copies.
+ */
+struct faio_slow_callback
+{
+  int fd;
+  void (*cb)(struct faio_loop *, struct faio_handle *, unsigned int);
+  uint64_t duration_ns;
+};
+
+/* See faio_stats_snapshot(). */
+struct faio_stats
+{
+  uint64_t polls;             /* Calls into the kernel to fetch events. */
+  uint64_t polls_empty;       /* Calls that returned no events. */
+  uint64_t polls_full;        /* Calls that returned a full batch. */
+  uint64_t events;            /* Events received from the kernel. */
+  uint64_t callbacks;         /* Handle callbacks invoked. */
+  uint64_t pending_replays;   /* Handles replayed from the pending queue. */
+  uint64_t budget_carryovers; /* Ready handles left for the next call. */
+  uint64_t blocked_ns;        /* Time spent waiting in the kernel. */
+  uint64_t callback_ns;       /* Time spent dispatching events. */
+};
 
+/* The io_uring backend needs Linux 6.0 or newer, it fails with ENOSYS on
+ * older kernels.
+ */
 FAIO_ATTRIBUTE_UNUSED
 static int faio_init(struct faio_loop *loop);
 
 FAIO_ATTRIBUTE_UNUSED
 static void faio_fini(struct faio_loop *loop);
 
+/* Wait at most |timeout| seconds for events, or indefinitely if it's
+ * negative. Sub-millisecond timeouts are honored where the platform
+ * allows it.
+ */
 FAIO_ATTRIBUTE_UNUSED
 static void faio_poll(struct faio_loop *loop, double timeout);
 
+/* Same as faio_poll() but with the timeout in nanoseconds. */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_poll_ns(struct faio_loop *loop, int64_t timeout);
+
 FAIO_ATTRIBUTE_UNUSED
 static int faio_add(struct faio_loop *loop,
                     struct faio_handle *handle,
@@ -52,7 +98,289 @@ static int faio_mod(struct faio_loop *loop,
 FAIO_ATTRIBUTE_UNUSED
 static int faio_del(struct faio_loop *loop, struct faio_handle *handle);
 
-#if defined(__linux__)
+/* Like faio_del() followed by close(handle->fd) but cheaper. Only use it
+ * when the file descriptor isn't shared with other processes or dup()'d.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_close(struct faio_loop *loop, struct faio_handle *handle);
+
+/* Run |cb| once after |timeout| seconds. Restarts the timer if it's
+ * already active. Timers are intrusive; |timer| must stay valid until it
+ * has fired or has been stopped. Zero it before first use.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_timer_start(struct faio_loop *loop,
+                             struct faio_timer *timer,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_timer *timer),
+                             double timeout);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_timer_stop(struct faio_loop *loop, struct faio_timer *timer);
+
+/* Async handles let other threads wake up the loop and hand it work.
+ * faio_async_send() is the only function that is safe to call from other
+ * threads. The callback receives the nodes that were sent since the last
+ * callback in FIFO order, or NULL if only NULL nodes were sent.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_async_init(struct faio_loop *loop,
+                           struct faio_async *async,
+                           void (*cb)(struct faio_loop *loop,
+                                      struct faio_async *async,
+                                      struct faio_async_node *nodes));
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_async_send(struct faio_async *async,
+                            struct faio_async_node *node);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_async_close(struct faio_loop *loop, struct faio_async *async);
+
+/* Invoke |cb| when the process receives |signum|. Multiple handles can
+ * watch the same signal. The signal is blocked and its default action is
+ * restored when the last handle stops watching it. Zero |sig| before
+ * first use.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_signal_start(struct faio_loop *loop,
+                             struct faio_signal *sig,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_signal *sig,
+                                        int signum),
+                             int signum);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_signal_stop(struct faio_loop *loop,
+                             struct faio_signal *sig);
+
+/* Let several threads call faio_poll() on |loop| at the same time. Each
+ * ready handle is dispatched by one of them and its callback never runs
+ * on two threads at once. Call it right after faio_init(); it fails with
+ * EBUSY once handles have been added. epoll backend only, fails with
+ * ENOTSUP elsewhere.
+ *
+ * faio_add(), faio_mod(), faio_del(), faio_close() and the timer functions
+ * can be called from any thread. Once faio_del() or faio_close() returns,
+ * the handle's callback won't start again but it may still be running on
+ * another thread; only free the handle when you know it isn't, e.g. by
+ * closing handles from their own callbacks. Async and signal handles must
+ * be set up before the other threads start. Timer and async callbacks run
+ * on one thread at a time, whichever gets to them first.
+ *
+ * The budget applies to each thread separately, and handles that are
+ * left over wait for the same thread's next faio_poll() call. Statistics,
+ * the watchdog, busy polling and the adaptive batch size don't work in
+ * this mode. Sub-millisecond timeouts need epoll_pwait2().
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_shared(struct faio_loop *loop);
+
+/* Maximum number of events that faio_poll() fetches from the kernel in one
+ * go. Defaults to 256. A |size| of zero makes the loop grow the batch when
+ * it keeps coming back full and shrink it again when it stays mostly empty.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_batch_size(struct faio_loop *loop, unsigned int size);
+
+/* Number of times the kernel had at least as many events as fit in the
+ * batch. If it keeps going up, the batch is too small.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static uint64_t faio_full_batches(const struct faio_loop *loop);
+
+/* Limit the handle callbacks that one faio_poll() call makes to |events|
+ * and the time it spends on them to |ns| nanoseconds. Zero means no limit,
+ * the default. Handles that are ready when the budget runs out are the
+ * first to be dispatched in the next call. The time limit is checked after
+ * every callback, it can't interrupt a slow one.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_set_budget(struct faio_loop *loop,
+                            unsigned int events,
+                            uint64_t ns);
+
+/* Handles with a higher priority are dispatched first when several are
+ * ready at once: FAIO_PRIORITY_HIGH, FAIO_PRIORITY_NORMAL (the default)
+ * or FAIO_PRIORITY_LOW. Call it after faio_add(). A handle that's waiting
+ * on the pending queue keeps its old priority until it's dispatched.
+ * Request completions of the io_uring backend aren't prioritized, they
+ * run as soon as they are reaped.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_priority(struct faio_loop *loop,
+                             struct faio_handle *handle,
+                             unsigned int priority);
+
+/* Copy the loop's statistics to |stats|. Statistics are only collected
+ * when faio is compiled with FAIO_STATS defined. Without it, this function
+ * zeroes |stats| and fails with ENOSYS.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_stats_snapshot(const struct faio_loop *loop,
+                               struct faio_stats *stats);
+
+/* Report handle callbacks that take |threshold_ns| nanoseconds or longer
+ * to |hook|. Only one in |sample| callbacks is timed; 0 and 1 time all of
+ * them. Pass a NULL |hook| to turn it off again.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_set_watchdog(struct faio_loop *loop,
+                              void (*hook)(struct faio_loop *loop,
+                                           const struct faio_slow_callback *),
+                              uint64_t threshold_ns,
+                              unsigned int sample);
+
+/* Allocator for objects of |size| bytes, typically structs that embed a
+ * struct faio_handle. Allocating and freeing are a few pointer operations
+ * and never call malloc. Memory is mapped in 2 MB chunks, backed by huge
+ * pages if possible. |prewarm| is the number of objects to map and fault
+ * in up front. The slab belongs to |loop|; faio_fini() releases it if
+ * faio_slab_fini() hasn't been called yet. Not thread-safe.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_slab_init(struct faio_loop *loop,
+                          struct faio_slab *slab,
+                          size_t size,
+                          unsigned int prewarm);
+
+FAIO_ATTRIBUTE_UNUSED
+static void *faio_slab_alloc(struct faio_slab *slab);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_slab_free(struct faio_slab *slab, void *p);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_slab_fini(struct faio_slab *slab);
+
+/* Write queue for |handle|. Queued buffers are written with as few
+ * system calls as possible when the queue is flushed; what the kernel
+ * doesn't take right away is written when the handle becomes writable.
+ * The queue turns FAIO_POLLOUT on and off as needed; the handle's
+ * callback should call faio_writeq_flush() when it gets FAIO_POLLOUT.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_init(struct faio_writeq *wq,
+                             struct faio_handle *handle);
+
+/* Queue |len| bytes at |base|. Neither |buf| nor the data may be touched
+ * until |cb| runs. |status| is 0 once the data has been written in full,
+ * or a negated errno when the write failed or was cancelled. |cb| can be
+ * NULL.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_push(struct faio_writeq *wq,
+                             struct faio_wbuf *buf,
+                             const void *base,
+                             size_t len,
+                             void (*cb)(struct faio_loop *loop,
+                                        struct faio_wbuf *buf,
+                                        int status));
+
+/* Returns 1 when every buffer has been written and, for zero-copy sends,
+ * released by the kernel.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_empty(const struct faio_writeq *wq);
+
+/* Write out as much as possible. Fails the remaining buffers and returns
+ * -1 on error. Does nothing while the queue is corked.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_flush(struct faio_loop *loop, struct faio_writeq *wq);
+
+/* Same as faio_writeq_flush() but tells the kernel that more data is
+ * coming (MSG_MORE), so a partial response isn't sent as a small packet.
+ * The next write without the hint pushes it out. Just a flush on systems
+ * without MSG_MORE and on fds that aren't sockets.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_flush_more(struct faio_loop *loop,
+                                  struct faio_writeq *wq);
+
+/* Corking holds back flushes in user space until faio_writeq_uncork(),
+ * use it while a response is queued piecemeal. Nothing is sent to the
+ * kernel in the meantime, see faio_writeq_flush_more() for that.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_cork(struct faio_writeq *wq);
+
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_uncork(struct faio_loop *loop, struct faio_writeq *wq);
+
+/* Fail all queued buffers with ECANCELED. Call it before faio_del() or
+ * faio_close(). Zero-copy buffers are failed too but the kernel may still
+ * read from them until the socket is gone.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_writeq_cancel(struct faio_loop *loop, struct faio_writeq *wq);
+
+/* Send batches of |threshold| bytes or more with MSG_ZEROCOPY. Their
+ * buffers complete when the kernel reports that it's done with the pages,
+ * which arrives as FAIO_POLLERR; the handle's callback should pass that
+ * to faio_writeq_reap(). Smaller batches are copied as usual, and the
+ * queue goes back to copying for good when the kernel reports that it
+ * had to copy anyway. Linux only, fails with ENOTSUP elsewhere.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_zerocopy(struct faio_writeq *wq, size_t threshold);
+
+/* Handles FAIO_POLLERR: completes the zero-copy buffers that the kernel
+ * has released. Returns -1 with errno set if the socket has an actual
+ * error, 0 otherwise.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_writeq_reap(struct faio_loop *loop, struct faio_writeq *wq);
+
+/* Accept connections on the listening socket |fd| and pass each one to
+ * |cb|, as a non-blocking, close-on-exec descriptor or as a negated errno
+ * when accept() fails. At most |batch| connections are accepted per loop
+ * iteration, zero means 64. When the process is out of file descriptors,
+ * the waiting connections are dropped and |cb| gets -EMFILE or -ENFILE.
+ * |flags| is zero or more of:
+ *
+ *   FAIO_LISTEN_DEFER      Only report connections once they have data,
+ *                          with TCP_DEFER_ACCEPT. Linux only.
+ *   FAIO_LISTEN_EXCLUSIVE  Wake up just one of the loops that listen on
+ *                          |fd|, with EPOLLEXCLUSIVE. epoll backend only.
+ *
+ * Flags that the platform doesn't support fail with ENOTSUP. Stopping the
+ * listener doesn't close |fd|.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_listener_start(struct faio_loop *loop,
+                               struct faio_listener *listener,
+                               void (*cb)(struct faio_loop *loop,
+                                          struct faio_listener *listener,
+                                          int fd),
+                               int fd,
+                               unsigned int batch,
+                               unsigned int flags);
+
+FAIO_ATTRIBUTE_UNUSED
+static void faio_listener_stop(struct faio_loop *loop,
+                               struct faio_listener *listener);
+
+/* Spin for up to |usecs| microseconds with non-blocking polls before
+ * blocking in the kernel. Zero disables busy polling. On Linux 6.9 and
+ * newer, the epoll backend also enables busy polling of the network
+ * device queues of the sockets in the set; setting SO_BUSY_POLL on the
+ * sockets has the same effect on older kernels.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static int faio_set_busy_poll(struct faio_loop *loop, unsigned int usecs);
+
+/* Number of times faio_poll() found work while spinning and after having
+ * blocked in the kernel, respectively.
+ */
+FAIO_ATTRIBUTE_UNUSED
+static void faio_busy_poll_stats(const struct faio_loop *loop,
+                                 uint64_t *spin_wakeups,
+                                 uint64_t *block_wakeups);
+
+#if defined(__linux__) && defined(FAIO_USE_URING)
+#include "faio-uring.h"
+#elif defined(__linux__)
 #include "faio-epoll.h"
 #elif defined(__sun)
 #include "faio-port.h"
@@ -66,6 +394,9 @@ static int faio_del(struct faio_loop *loop, struct faio_handle *handle);
 #error "Platform not supported."
 #endif
 
+#include "faio-listener.h"
+#include "faio-common.h"
+
 #undef FAIO_ATTRIBUTE_UNUSED
 #undef FAIO_TIMESPEC_SUB
 